@@ -0,0 +1,402 @@
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "headless.h"
+#include "programs.h"
+#include "selftest.h"
+#include "vm.h"
+#include "vmcodecache.h"
+#include "vmscheduler.h"
+#include "vmsimd.h"
+#include "vmsnapshot.h"
+
+#define BENCH_RUNS 5
+
+static const char *default_benchmarks[] = {
+    "loop", "factorial", "churn", "retain", "fill",
+    "vsum", "ssum", "vadd", "sadd",
+    "ncall", "bcall", "nocall"
+};
+
+// set by --cache, shared by every VM the runner creates
+static VMCodeCache *code_cache = nullptr;
+
+// set by --metrics and --perf
+static FILE *metrics_out = nullptr;
+static bool hw_counters = false;
+
+// set by --inline; -1 keeps the VM's default (VM_INLINE)
+static int inline_mode = -1;
+
+// set by --globals and --access; every VM maps the same file, MAP_SHARED
+static const char *globals_file = nullptr;
+static VM::GLOBALS_ACCESS globals_access = VM::GLOBALS_NORMAL;
+
+static bool configure(VM *vm, const VM_PROGRAM *prog)
+{
+    vm->set_code_cache(code_cache);
+    vm->set_hardware_counters(hw_counters);
+    if (inline_mode >= 0) vm->set_inlining((VM::INLINE_MODE)inline_mode);
+    if (!globals_file) {
+        return true;
+    }
+
+    // the whole file, but at least the globals the program uses
+    QFileInfo info(globals_file);
+    qint64 nglobals = info.exists() ? info.size() / (qint64)sizeof(int) : 0;
+    return vm->map_globals_file(globals_file, qMax(nglobals, (qint64)prog->nglobals), globals_access);
+}
+
+// Writes one JSON object per line: the given leading fields, then every metric
+static void dump_metrics(const char *fields, const qint64 values[METRIC_COUNT])
+{
+    if (!metrics_out) return;
+
+    fprintf(metrics_out, "{%s", fields);
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        if (i > METRIC_HW_SAMPLES && values[METRIC_HW_SAMPLES] == 0) {
+            fprintf(metrics_out, ", \"%s\": null", VMMetrics::name(i));
+        } else {
+            fprintf(metrics_out, ", \"%s\": %lld", VMMetrics::name(i), values[i]);
+        }
+    }
+    fprintf(metrics_out, "}\n");
+}
+
+static qint64 bench_program(const VM_PROGRAM *prog)
+{
+    qint64 best = -1;
+    HEAP_STATS stats;
+    INLINE_STATS inlining;
+    qint64 metrics[METRIC_COUNT];
+    memset(&stats, 0, sizeof(stats));
+    memset(&inlining, 0, sizeof(inlining));
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        VM vm(prog->code, prog->code_size, prog->nglobals, prog->startip);
+        if (!configure(&vm, prog)) {
+            return -1;
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        vm.exec(prog->startip, false);
+        qint64 elapsed = timer.nsecsElapsed();
+
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+            stats = vm.heap_stats();
+            inlining = vm.inline_stats();
+            vm.metrics().read(metrics);
+        }
+    }
+
+    char fields[128];
+    snprintf(fields, sizeof(fields), "\"mode\": \"bench\", \"program\": \"%s\", \"ns\": %lld",
+             prog->name, best);
+    dump_metrics(fields, metrics);
+
+    double secs = best / 1e9;
+    printf("%-12s %10.3f %10lld %12.1f %6lld %12.1f %12.1f\n",
+           prog->name, best / 1e6,
+           stats.objects_allocated,
+           secs > 0 ? stats.bytes_allocated / secs / (1024 * 1024) : 0.0,
+           stats.collections,
+           stats.gc_pause_max_ns / 1e3,
+           stats.gc_pause_total_ns / 1e3);
+    if (inlining.sites > 0) {
+        printf("%-12s inlined %d call sites, %d constant arguments, %d passes\n",
+               "", inlining.sites, inlining.constant_args, inlining.passes);
+    }
+    return best;
+}
+
+static int run_benchmarks(int argc, char *argv[])
+{
+    printf("vector kernels: %s\n", simd_kernels()->name);
+    printf("%-12s %10s %10s %12s %6s %12s %12s\n",
+           "program", "best ms", "allocs", "alloc MB/s", "gcs", "gc max us", "gc total us");
+
+    qint64 native = -1, bytecode = -1, none = -1;
+
+    int count = argc > 0 ? argc : (int)(sizeof(default_benchmarks) / sizeof(default_benchmarks[0]));
+    for (int i = 0; i < count; i++) {
+        const char *name = argc > 0 ? argv[i] : default_benchmarks[i];
+        const VM_PROGRAM *prog = find_program(name);
+        if (!prog) {
+            fprintf(stderr, "unknown program: %s\n", name);
+            return 1;
+        }
+        qint64 best = bench_program(prog);
+        if (best < 0) {
+            return 1;
+        }
+        if (strcmp(name, "ncall") == 0) native = best;
+        if (strcmp(name, "bcall") == 0) bytecode = best;
+        if (strcmp(name, "nocall") == 0) none = best;
+    }
+
+    // round trip = loop with the call minus the same loop without it
+    if (none >= 0 && native >= 0) {
+        printf("native call round trip: %.1f ns\n", (double)(native - none) / CALL_REPEAT);
+    }
+    if (none >= 0 && bytecode >= 0) {
+        printf("bytecode call round trip: %.1f ns\n", (double)(bytecode - none) / CALL_REPEAT);
+    }
+    return 0;
+}
+
+static const char *state_names[] = { "suspended", "finished", "halted", "trapped" };
+
+static int run_schedule(int argc, char *argv[])
+{
+    int nthreads = QThread::idealThreadCount();
+    qint64 slice = DEFAULT_SLICE;
+    qint64 limit = 0;
+
+    int i = 0;
+    for (; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+        if (strcmp(argv[i], "--threads") == 0) nthreads = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--slice") == 0) slice = atoll(argv[i + 1]);
+        else if (strcmp(argv[i], "--limit") == 0) limit = atoll(argv[i + 1]);
+        else break;
+    }
+    if (i >= argc || slice <= 0) {
+        fprintf(stderr, "usage: vm --schedule [--threads N] [--slice S] [--limit L] program...\n");
+        return 1;
+    }
+
+    VMScheduler scheduler(nthreads, slice);
+    QVector<VM *> vms;
+    QVector<const VM_PROGRAM *> progs;
+    for (; i < argc; i++) {
+        const VM_PROGRAM *prog = find_program(argv[i]);
+        if (!prog) {
+            fprintf(stderr, "unknown program: %s\n", argv[i]);
+            qDeleteAll(vms);
+            return 1;
+        }
+        VM *vm = new VM(prog->code, prog->code_size, prog->nglobals, prog->startip);
+        vms.append(vm);
+        if (!configure(vm, prog)) {
+            qDeleteAll(vms);
+            return 1;
+        }
+        progs.append(prog);
+        scheduler.submit(vm, limit);
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    scheduler.run();
+    qint64 elapsed = timer.nsecsElapsed();
+
+    printf("%-4s %-12s %-10s %12s %8s\n", "job", "program", "state", "retired", "slices");
+    for (int id = 0; id < scheduler.count(); id++) {
+        const VM_JOB &job = scheduler.job(id);
+        printf("%-4d %-12s %-10s %12lld %8d\n", id, progs[id]->name,
+               state_names[job.state], job.vm->instructions_retired(), job.slices);
+
+        char fields[128];
+        qint64 metrics[METRIC_COUNT];
+        snprintf(fields, sizeof(fields), "\"mode\": \"schedule\", \"job\": %d, \"program\": \"%s\", \"state\": \"%s\"",
+                 id, progs[id]->name, state_names[job.state]);
+        job.vm->metrics().read(metrics);
+        dump_metrics(fields, metrics);
+    }
+    printf("%d jobs on %d threads in %.3f ms\n", scheduler.count(), nthreads, elapsed / 1e6);
+
+    qDeleteAll(vms);
+    return 0;
+}
+
+// Prints the final state and the first globals of a save/restore run; the
+// VM has stopped, so its globals can be read in place
+static void print_result(const VM *vm, const VM_PROGRAM *prog)
+{
+    printf("%s: %s after %lld instructions\n", prog->name,
+           state_names[vm->get_state()], vm->instructions_retired());
+    printf("globals:");
+    for (qint64 i = 0; i < vm->nglobals && i < 16; i++) {
+        printf(" %d", vm->globals[i]);
+    }
+    printf("\n");
+}
+
+// vm --save FILE --after N program: run N instructions, write a snapshot
+static int run_save(int argc, char *argv[])
+{
+    if (argc != 4 || strcmp(argv[1], "--after") != 0 || atoll(argv[2]) <= 0) {
+        fprintf(stderr, "usage: vm --save FILE --after N program\n");
+        return 1;
+    }
+    const VM_PROGRAM *prog = find_program(argv[3]);
+    if (!prog) {
+        fprintf(stderr, "unknown program: %s\n", argv[3]);
+        return 1;
+    }
+
+    VM vm(prog->code, prog->code_size, prog->nglobals, prog->startip);
+    if (!configure(&vm, prog)) {
+        return 1;
+    }
+    if (vm.run_slice(atoll(argv[2])) != VM::VM_SUSPENDED) {
+        fprintf(stderr, "%s %s before the snapshot\n", prog->name, state_names[vm.get_state()]);
+        return 1;
+    }
+
+    VMSnapshot snap;
+    vm.snapshot(&snap);
+    QByteArray data = snap.serialize();
+    QFile file(argv[0]);
+    if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size()) {
+        fprintf(stderr, "cannot write snapshot to %s\n", argv[0]);
+        return 1;
+    }
+    printf("%s: saved at ip=%d after %lld instructions (%d bytes)\n",
+           prog->name, vm.source_address(snap.ip), vm.instructions_retired(), data.size());
+    return 0;
+}
+
+// vm --restore FILE program: continue a saved run to the end. The globals
+// come from the snapshot, so --globals does not apply.
+static int run_restore(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: vm --restore FILE program\n");
+        return 1;
+    }
+    if (globals_file) {
+        fprintf(stderr, "--globals cannot be used with --restore: the snapshot holds the globals\n");
+        return 1;
+    }
+    const VM_PROGRAM *prog = find_program(argv[1]);
+    if (!prog) {
+        fprintf(stderr, "unknown program: %s\n", argv[1]);
+        return 1;
+    }
+    QFile file(argv[0]);
+    if (!file.open(QIODevice::ReadOnly)) {
+        fprintf(stderr, "cannot read snapshot from %s\n", argv[0]);
+        return 1;
+    }
+
+    VMSnapshot snap;
+    VM vm(prog->code, prog->code_size, prog->nglobals, prog->startip);
+    if (!configure(&vm, prog)) {
+        return 1;
+    }
+    if (!snap.deserialize(file.readAll()) || !vm.restore(&snap)) {
+        fprintf(stderr, "cannot restore %s from %s\n", prog->name, argv[0]);
+        return 1;
+    }
+    vm.run_slice(LLONG_MAX);
+    print_result(&vm, prog);
+    return vm.get_state() == VM::VM_FINISHED ? 0 : 1;
+}
+
+static void print_cache_stats()
+{
+    CODE_CACHE_STATS stats = code_cache->stats();
+    printf("code cache: %lld hits, %lld misses, %lld stores, %lld evictions, %lld rejected\n",
+           stats.hits, stats.misses, stats.stores, stats.evictions, stats.rejected);
+}
+
+// Leading options shared by every mode: --cache DIR, --metrics FILE (- for
+// stdout), --perf, --inline off|static|profile and --globals FILE
+// [--access seq|random]. Returns the index of the mode, or -1 on error.
+static int parse_options(int argc, char *argv[], bool apply)
+{
+    int i = 1;
+    while (i < argc) {
+        if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            if (apply) code_cache = new VMCodeCache(argv[i + 1]);
+            i += 2;
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+            if (apply) {
+                metrics_out = strcmp(argv[i + 1], "-") == 0 ? stdout : fopen(argv[i + 1], "w");
+                if (!metrics_out) {
+                    fprintf(stderr, "cannot write metrics to %s\n", argv[i + 1]);
+                    return -1;
+                }
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            if (apply) hw_counters = true;
+            i++;
+        } else if (strcmp(argv[i], "--inline") == 0 && i + 1 < argc) {
+            if (apply) {
+                const char *mode = argv[i + 1];
+                if (strcmp(mode, "off") == 0) inline_mode = VM::INLINE_OFF;
+                else if (strcmp(mode, "static") == 0) inline_mode = VM::INLINE_STATIC;
+                else if (strcmp(mode, "profile") == 0) inline_mode = VM::INLINE_PROFILE;
+                else {
+                    fprintf(stderr, "unknown inlining mode: %s\n", mode);
+                    return -1;
+                }
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "--globals") == 0 && i + 1 < argc) {
+            if (apply) globals_file = argv[i + 1];
+            i += 2;
+        } else if (strcmp(argv[i], "--access") == 0 && i + 1 < argc) {
+            if (apply) {
+                const char *access = argv[i + 1];
+                if (strcmp(access, "seq") == 0) globals_access = VM::GLOBALS_SEQUENTIAL;
+                else if (strcmp(access, "random") == 0) globals_access = VM::GLOBALS_RANDOM;
+                else {
+                    fprintf(stderr, "unknown access pattern: %s\n", access);
+                    return -1;
+                }
+            }
+            i += 2;
+        } else {
+            break;
+        }
+    }
+    return i;
+}
+
+bool is_headless(int argc, char *argv[])
+{
+    int mode = parse_options(argc, argv, false);
+    return argc > mode && (strcmp(argv[mode], "--bench") == 0 || strcmp(argv[mode], "--schedule") == 0
+                           || strcmp(argv[mode], "--save") == 0 || strcmp(argv[mode], "--restore") == 0
+                           || strcmp(argv[mode], "--selftest") == 0);
+}
+
+int run_headless(int argc, char *argv[])
+{
+    int mode = parse_options(argc, argv, true);
+    int ret = 1;
+
+    if (mode < 0) {
+        // already reported
+    } else if (strcmp(argv[mode], "--bench") == 0) {
+        ret = run_benchmarks(argc - mode - 1, argv + mode + 1);
+    } else if (strcmp(argv[mode], "--schedule") == 0) {
+        ret = run_schedule(argc - mode - 1, argv + mode + 1);
+    } else if (strcmp(argv[mode], "--save") == 0) {
+        ret = run_save(argc - mode - 1, argv + mode + 1);
+    } else if (strcmp(argv[mode], "--restore") == 0) {
+        ret = run_restore(argc - mode - 1, argv + mode + 1);
+    } else if (strcmp(argv[mode], "--selftest") == 0) {
+        ret = run_selftest();
+    }
+    if (code_cache) {
+        print_cache_stats();
+        delete code_cache;
+        code_cache = nullptr;
+    }
+    if (metrics_out && metrics_out != stdout) {
+        fclose(metrics_out);
+    }
+    metrics_out = nullptr;
+    return ret;
+}
@@ -0,0 +1,20 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+// Command line modes that run built-in programs without the GUI:
+//
+//   vm --bench [program...]    time programs, report allocation and GC stats
+//   vm --schedule [--threads N] [--slice S] [--limit L] program...
+//                              time-slice the programs over a thread pool
+//   vm --save FILE --after N program
+//                              run N instructions, write a serialized snapshot
+//   vm --restore FILE program  continue a saved run and print its globals
+//   vm --selftest              run the regression checks, see selftest.h
+//
+// Options that apply to every mode come first: --cache DIR, --metrics FILE,
+// --perf, --inline off|static|profile, --globals FILE, --access seq|random.
+
+bool is_headless(int argc, char *argv[]);
+int run_headless(int argc, char *argv[]);
+
+#endif // HEADLESS_H
@@ -1,8 +1,15 @@
 #include "mainwindow.h"
+#include "headless.h"
 #include <QApplication>
+#include <QCoreApplication>
 
 int main(int argc, char *argv[])
 {
+    if (is_headless(argc, argv)) {
+        QCoreApplication a(argc, argv);
+        return run_headless(argc, argv);
+    }
+
     QApplication a(argc, argv);
     MainWindow w;
     w.show();
@@ -1,71 +1,9 @@
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 
+#include "programs.h"
 #include "vm.h"
 
-int hello[] = {
-    VM::ICONST, 1234,
-    VM::PRINT,
-    VM::ICONST, 5678,
-    VM::PRINT,
-    VM::HALT
-};
-
-int loop[] = {
-    // .GLOBALS 2; N, I
-    // N = 10                      ADDRESS
-    VM::ICONST, 10,            // 0
-    VM::GSTORE, 0,             // 2
-    // I = 0
-    VM::ICONST, 0,             // 4
-    VM::GSTORE, 1,             // 6
-    // WHILE I<N:
-    // START (8):
-    VM::GLOAD, 1,              // 8
-    VM::GLOAD, 0,              // 10
-    VM::ILT,                   // 12
-    VM::BRF, 27,               // 13
-    //     PRINT current I value
-    VM::GLOAD, 1,              // 15
-    VM::PRINT,                 // 17
-    //     I = I + 1
-    VM::GLOAD, 1,              // 18
-    VM::ICONST, 1,             // 20
-    VM::IADD,                  // 22
-    VM::GSTORE, 1,             // 23
-    VM::BR, 8,                 // 25
-    // DONE (27):
-    // PRINT "LOOPED "+N+" TIMES."
-    VM::HALT                   // 27
-};
-
-const int FACTORIAL_ADDRESS = 0;
-int factorial[] = {
-    //.def factorial: ARGS=1, LOCALS=0	ADDRESS
-    //	IF N < 2 RETURN 1
-    VM::LOAD, 0,                // 0
-    VM::ICONST, 2,              // 2
-    VM::ILT,                    // 4
-    VM::BRF, 10,                // 5
-    VM::ICONST, 1,              // 7
-    VM::RET,                    // 9
-    //CONT:
-    //	RETURN N * FACT(N-1)
-    VM::LOAD, 0,                // 10
-    VM::LOAD, 0,                // 12
-    VM::ICONST, 1,              // 14
-    VM::ISUB,                   // 16
-    VM::CALL, FACTORIAL_ADDRESS, 1, 0,    // 17
-    VM::IMUL,                   // 21
-    VM::RET,                    // 22
-    //.DEF MAIN: ARGS=0, LOCALS=0
-    // PRINT FACT(1)
-    VM::ICONST, 15,              // 23    <-- MAIN METHOD!
-    VM::CALL, FACTORIAL_ADDRESS, 1, 0,    // 25
-    VM::PRINT,                  // 29
-    VM::HALT                    // 30
-};
-
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow)
@@ -98,12 +36,15 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->actionHello, &QAction::triggered, this, &MainWindow::runHello);
     connect(ui->actionLoop, &QAction::triggered, this, &MainWindow::runLoop);
     connect(ui->actionFactorial, &QAction::triggered, this, &MainWindow::runFactorial);
+    connect(ui->actionArrays, &QAction::triggered, this, &MainWindow::runArrays);
+    connect(ui->actionNatives, &QAction::triggered, this, &MainWindow::runNatives);
     
     // Connect toolbar actions
     connect(ui->actionE_xit, &QAction::triggered, this, &MainWindow::close);
     connect(ui->actionRun, &QAction::triggered, this, &MainWindow::onRunAction);
     connect(ui->actionPause, &QAction::triggered, this, &MainWindow::onPauseAction);
     connect(ui->actionHalt, &QAction::triggered, this, &MainWindow::onHaltAction);
+    connect(ui->actionSnapshot, &QAction::triggered, this, &MainWindow::onSnapshotAction);
 
     QMetaObject::invokeMethod(this, "runHello", Qt::QueuedConnection);
 }
@@ -144,6 +85,19 @@ void MainWindow::updateProgramListing(int *code, int codeSize, const QString &pr
             case VM::CALL: instName = "call"; break;
             case VM::RET: instName = "ret"; break;
             case VM::HALT: instName = "halt"; break;
+            case VM::GSYNC: instName = "gsync"; break;
+            case VM::NEWARR: instName = "newarr"; break;
+            case VM::ALOAD: instName = "aload"; break;
+            case VM::ASTORE: instName = "astore"; break;
+            case VM::ALEN: instName = "alen"; break;
+            case VM::VADD: instName = "vadd"; break;
+            case VM::VMUL: instName = "vmul"; break;
+            case VM::VSUM: instName = "vsum"; break;
+            case VM::VMIN: instName = "vmin"; break;
+            case VM::VMAX: instName = "vmax"; break;
+            case VM::VFILL: instName = "vfill"; break;
+            case VM::VCOPY: instName = "vcopy"; break;
+            case VM::NCALL: instName = "ncall"; break;
         }
         
         QString line = QString("%1: %2").arg(i, 4, 10, QLatin1Char('0')).arg(instName, -8);
@@ -161,6 +115,9 @@ void MainWindow::updateProgramListing(int *code, int codeSize, const QString &pr
             case VM::GSTORE:
                 numOperands = 1;
                 break;
+            case VM::NCALL:
+                numOperands = 2;
+                break;
             case VM::CALL:
                 numOperands = 3;
                 break;
@@ -195,7 +152,8 @@ void MainWindow::run()
     ui->memory->clear();
     ui->instructions->clear();
 
-    vm = new VM(factorial, sizeof(factorial), 0);
+    const VM_PROGRAM *prog = find_program("factorial");
+    vm = new VM(prog->code, prog->code_size, prog->nglobals);
 
     connect(vm, &VM::finished, vm, &QObject::deleteLater);
     vm->start();
@@ -203,14 +161,23 @@ void MainWindow::run()
     vm->print_data(vm->globals, vm->nglobals);
 }
 
-void MainWindow::runProgram(int *code, int codeSize, const QString &programName, int nglobals, int ip)
+void MainWindow::runProgram(int *code, int codeSize, const QString &programName, int nglobals, int ip, const VMSnapshot *snapshot)
 {
     ui->stdoutEdit->clear();
     ui->stack->clear();
     ui->memory->clear();
     ui->instructions->clear();
+    ui->statistics->clear();
+
+    // A checkpoint only applies to the program it was taken from
+    if (code != lastCode) {
+        checkpoint.clear();
+    }
 
     vm = new VM(code, codeSize, nglobals, ip);
+    if (snapshot) {
+        vm->restore(snapshot);
+    }
 
     connect(vm, SIGNAL(hasStdout(QString)), ui->stdoutEdit, SLOT(appendPlainText(QString)));
     connect(vm, SIGNAL(hasStack(QString)),  ui->stack, SLOT(appendPlainText(QString)));
@@ -224,6 +191,7 @@ void MainWindow::runProgram(int *code, int codeSize, const QString &programName,
     connect(vm, SIGNAL(finished()), this, SLOT(onVmFinished()));
     connect(vm, SIGNAL(finished()), vm, SLOT(deleteLater()));
     connect(vm, SIGNAL(pausedChanged(bool)), this, SLOT(onVmPaused(bool)));
+    connect(vm, SIGNAL(metricsChanged()), this, SLOT(onMetricsChanged()));
     
     // Update window title with current program name
     currentProgramName = programName;
@@ -242,19 +210,35 @@ void MainWindow::runProgram(int *code, int codeSize, const QString &programName,
     vm->start();
 }
 
+void MainWindow::runProgram(const char *name)
+{
+    const VM_PROGRAM *prog = find_program(name);
+    runProgram(prog->code, prog->code_size, prog->title, prog->nglobals, prog->startip);
+}
+
 void MainWindow::runHello()
 {
-    runProgram(hello, sizeof(hello), "Hello Program", 0, 0);
+    runProgram("hello");
 }
 
 void MainWindow::runLoop()
 {
-    runProgram(loop, sizeof(loop), "Loop Program", 2, 0);
+    runProgram("loop");
 }
 
 void MainWindow::runFactorial()
 {
-    runProgram(factorial, sizeof(factorial), "Factorial Program", 0, 23);
+    runProgram("factorial");
+}
+
+void MainWindow::runArrays()
+{
+    runProgram("arrays");
+}
+
+void MainWindow::runNatives()
+{
+    runProgram("natives");
 }
 
 QString MainWindow::formatBinaryDisplay(int value)
@@ -273,6 +257,9 @@ QString MainWindow::formatBinaryDisplay(int value)
 
 void MainWindow::onIpChange(int newIP)
 {
+    // the listing shows the program as written, not as inlined
+    VM *source = qobject_cast<VM *>(sender());
+    if (source) newIP = source->source_address(newIP);
     ui->ip->setText(formatBinaryDisplay(newIP));
 }
 
@@ -296,6 +283,8 @@ void MainWindow::highlightCurrentLine(int currentIP)
     if (programLines.isEmpty() || currentIP < 0) {
         return;
     }
+    VM *source = qobject_cast<VM *>(sender());
+    if (source) currentIP = source->source_address(currentIP);
     
     // Find which line corresponds to the current IP
     int highlightLineIndex = -1;
@@ -354,6 +343,28 @@ void MainWindow::onVmPaused(bool paused)
     ui->actionPause->setChecked(paused);
 }
 
+void MainWindow::onMetricsChanged()
+{
+    VM *source = qobject_cast<VM *>(sender());
+    if (!source) return;
+
+    // counted from the GUI thread, so the VM can tell how far behind we are
+    VMMetrics &metrics = source->metrics();
+    metrics.add(METRIC_GUI_DELIVERED, 1);
+
+    qint64 values[METRIC_COUNT];
+    metrics.read(values);
+
+    QString text;
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        if (i > METRIC_HW_SAMPLES && values[METRIC_HW_SAMPLES] == 0) continue;
+        text += QString("%1 %2\n").arg(VMMetrics::name(i), -20).arg(values[i]);
+    }
+    text += QString("%1 %2\n").arg("gui_backlog", -20)
+                               .arg(values[METRIC_GUI_POSTED] - values[METRIC_GUI_DELIVERED]);
+    ui->statistics->setPlainText(text);
+}
+
 void MainWindow::onRunAction()
 {
     // Always restart the VM from the beginning
@@ -364,8 +375,9 @@ void MainWindow::onRunAction()
             vm = nullptr;
         }
         
-        // Restart the last program
-        runProgram(lastCode, lastCodeSize, lastProgramName, lastNglobals, lastIp);
+        // Restart the last program, from its checkpoint if one was taken
+        runProgram(lastCode, lastCodeSize, lastProgramName, lastNglobals, lastIp,
+                   checkpoint.isValid() ? &checkpoint : nullptr);
     }
 }
 
@@ -391,3 +403,12 @@ void MainWindow::onHaltAction()
         vm->halt();
     }
 }
+
+void MainWindow::onSnapshotAction()
+{
+    if (vm && isRunning && vm->snapshot(&checkpoint)) {
+        ui->statusBar->showMessage(QString("Checkpoint taken at ip %1").arg(checkpoint.ip), 3000);
+    } else {
+        ui->statusBar->showMessage("Pause the VM to take a checkpoint", 3000);
+    }
+}
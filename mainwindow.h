@@ -6,6 +6,7 @@
 #include <QVector>
 
 #include "vm.h"
+#include "vmsnapshot.h"
 
 namespace Ui {
 class MainWindow;
@@ -23,6 +24,8 @@ public slots:
     void runHello();
     void runLoop();
     void runFactorial();
+    void runArrays();
+    void runNatives();
     void onIpChange(int newIP);
     void onSpChange(int newSP);
     void onCallSpChange(int newSP);
@@ -32,12 +35,15 @@ public slots:
     void onRunAction();
     void onPauseAction();
     void onHaltAction();
+    void onSnapshotAction();
     void onVmPaused(bool paused);
+    void onMetricsChanged();
 
 private:
     void updateWindowTitle();
     void updateProgramListing(int *code, int codeSize, const QString &programName);
-    void runProgram(int *code, int codeSize, const QString &programName, int nglobals = 0, int ip = 0);
+    void runProgram(const char *name);
+    void runProgram(int *code, int codeSize, const QString &programName, int nglobals = 0, int ip = 0, const VMSnapshot *snapshot = nullptr);
     QString formatBinaryDisplay(int value);
     Ui::MainWindow *ui;
 
@@ -60,6 +66,9 @@ private:
     QString lastProgramName;
     int lastNglobals;
     int lastIp;
+
+    // Checkpoint of the last program, restored by the Run action
+    VMSnapshot checkpoint;
 };
 
 #endif // MAINWINDOW_H
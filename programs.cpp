@@ -0,0 +1,424 @@
+#include <string.h>
+
+#include "programs.h"
+#include "vm.h"
+
+int hello[] = {
+    VM::ICONST, 1234,
+    VM::PRINT,
+    VM::ICONST, 5678,
+    VM::PRINT,
+    VM::HALT
+};
+
+int loop[] = {
+    // .GLOBALS 2; N, I
+    // N = 10                      ADDRESS
+    VM::ICONST, 10,            // 0
+    VM::GSTORE, 0,             // 2
+    // I = 0
+    VM::ICONST, 0,             // 4
+    VM::GSTORE, 1,             // 6
+    // WHILE I<N:
+    // START (8):
+    VM::GLOAD, 1,              // 8
+    VM::GLOAD, 0,              // 10
+    VM::ILT,                   // 12
+    VM::BRF, 27,               // 13
+    //     PRINT current I value
+    VM::GLOAD, 1,              // 15
+    VM::PRINT,                 // 17
+    //     I = I + 1
+    VM::GLOAD, 1,              // 18
+    VM::ICONST, 1,             // 20
+    VM::IADD,                  // 22
+    VM::GSTORE, 1,             // 23
+    VM::BR, 8,                 // 25
+    // DONE (27):
+    // PRINT "LOOPED "+N+" TIMES."
+    VM::HALT                   // 27
+};
+
+const int FACTORIAL_ADDRESS = 0;
+int factorial[] = {
+    //.def factorial: ARGS=1, LOCALS=0	ADDRESS
+    //	IF N < 2 RETURN 1
+    VM::LOAD, 0,                // 0
+    VM::ICONST, 2,              // 2
+    VM::ILT,                    // 4
+    VM::BRF, 10,                // 5
+    VM::ICONST, 1,              // 7
+    VM::RET,                    // 9
+    //CONT:
+    //	RETURN N * FACT(N-1)
+    VM::LOAD, 0,                // 10
+    VM::LOAD, 0,                // 12
+    VM::ICONST, 1,              // 14
+    VM::ISUB,                   // 16
+    VM::CALL, FACTORIAL_ADDRESS, 1, 0,    // 17
+    VM::IMUL,                   // 21
+    VM::RET,                    // 22
+    //.DEF MAIN: ARGS=0, LOCALS=0
+    // PRINT FACT(1)
+    VM::ICONST, 15,              // 23    <-- MAIN METHOD!
+    VM::CALL, FACTORIAL_ADDRESS, 1, 0,    // 25
+    VM::PRINT,                  // 29
+    VM::HALT                    // 30
+};
+
+int arrays[] = {
+    // .GLOBALS 1; A
+    // A = NEW INT[3]              ADDRESS
+    VM::ICONST, 3,             // 0
+    VM::NEWARR,                // 2
+    VM::GSTORE, 0,             // 3
+    // A[0] = 10; A[1] = 20; A[2] = 30
+    VM::GLOAD, 0,              // 5
+    VM::ICONST, 0,             // 7
+    VM::ICONST, 10,            // 9
+    VM::ASTORE,                // 11
+    VM::GLOAD, 0,              // 12
+    VM::ICONST, 1,             // 14
+    VM::ICONST, 20,            // 16
+    VM::ASTORE,                // 18
+    VM::GLOAD, 0,              // 19
+    VM::ICONST, 2,             // 21
+    VM::ICONST, 30,            // 23
+    VM::ASTORE,                // 25
+    // PRINT A[1]
+    VM::GLOAD, 0,              // 26
+    VM::ICONST, 1,             // 28
+    VM::ALOAD,                 // 30
+    VM::PRINT,                 // 31
+    // PRINT LEN(A)
+    VM::GLOAD, 0,              // 32
+    VM::ALEN,                  // 34
+    VM::PRINT,                 // 35
+    VM::HALT                   // 36
+};
+
+int natives[] = {
+    // PRINT HASH32(42)            ADDRESS
+    VM::ICONST, 42,            // 0
+    VM::NCALL, NATIVE_HASH32, 1,    // 2
+    VM::PRINT,                 // 5
+    // PRINT IMAX(ISQRT(1000), 20)
+    VM::ICONST, 1000,          // 6
+    VM::NCALL, NATIVE_ISQRT, 1,     // 8
+    VM::ICONST, 20,            // 11
+    VM::NCALL, NATIVE_IMAX, 2,      // 13
+    VM::PRINT,                 // 16
+    VM::HALT                   // 17
+};
+
+// Allocation benchmarks
+
+int churn[] = {
+    // .GLOBALS 1; I
+    // FOR I = 0; I < 100000: NEW INT[16] (garbage)
+    VM::ICONST, 0,             // 0
+    VM::GSTORE, 0,             // 2
+    // START (4):
+    VM::GLOAD, 0,              // 4
+    VM::ICONST, 100000,        // 6
+    VM::ILT,                   // 8
+    VM::BRF, 24,               // 9
+    VM::ICONST, 16,            // 11
+    VM::NEWARR,                // 13
+    VM::POP,                   // 14
+    VM::GLOAD, 0,              // 15
+    VM::ICONST, 1,             // 17
+    VM::IADD,                  // 19
+    VM::GSTORE, 0,             // 20
+    VM::BR, 4,                 // 22
+    // DONE (24):
+    VM::HALT                   // 24
+};
+
+int retain[] = {
+    // .GLOBALS 2; I, A
+    // FOR I = 0; I < 20000: A = NEW INT[8]; NEW INT[4] (garbage)
+    // every collection has to slide the live A down past garbage
+    VM::ICONST, 0,             // 0
+    VM::GSTORE, 0,             // 2
+    // START (4):
+    VM::GLOAD, 0,              // 4
+    VM::ICONST, 20000,         // 6
+    VM::ILT,                   // 8
+    VM::BRF, 29,               // 9
+    VM::ICONST, 8,             // 11
+    VM::NEWARR,                // 13
+    VM::GSTORE, 1,             // 14
+    VM::ICONST, 4,             // 16
+    VM::NEWARR,                // 18
+    VM::POP,                   // 19
+    VM::GLOAD, 0,              // 20
+    VM::ICONST, 1,             // 22
+    VM::IADD,                  // 24
+    VM::GSTORE, 0,             // 25
+    VM::BR, 4,                 // 27
+    // DONE (29): PRINT LEN(A)
+    VM::GLOAD, 1,              // 29
+    VM::ALEN,                  // 31
+    VM::PRINT,                 // 32
+    VM::HALT                   // 33
+};
+
+int fill[] = {
+    // .GLOBALS 3; I, A, SUM
+    // A = NEW INT[1000]           ADDRESS
+    VM::ICONST, 1000,          // 0
+    VM::NEWARR,                // 2
+    VM::GSTORE, 1,             // 3
+    VM::ICONST, 0,             // 5
+    VM::GSTORE, 0,             // 7
+    // FILL (9): WHILE I < LEN(A): A[I] = I
+    VM::GLOAD, 0,              // 9
+    VM::GLOAD, 1,              // 11
+    VM::ALEN,                  // 13
+    VM::ILT,                   // 14
+    VM::BRF, 33,               // 15
+    VM::GLOAD, 1,              // 17
+    VM::GLOAD, 0,              // 19
+    VM::GLOAD, 0,              // 21
+    VM::ASTORE,                // 23
+    VM::GLOAD, 0,              // 24
+    VM::ICONST, 1,             // 26
+    VM::IADD,                  // 28
+    VM::GSTORE, 0,             // 29
+    VM::BR, 9,                 // 31
+    // (33): I = 0; SUM = 0
+    VM::ICONST, 0,             // 33
+    VM::GSTORE, 0,             // 35
+    VM::ICONST, 0,             // 37
+    VM::GSTORE, 2,             // 39
+    // SUM (41): WHILE I < LEN(A): SUM = SUM + A[I]
+    VM::GLOAD, 0,              // 41
+    VM::GLOAD, 1,              // 43
+    VM::ALEN,                  // 45
+    VM::ILT,                   // 46
+    VM::BRF, 68,               // 47
+    VM::GLOAD, 2,              // 49
+    VM::GLOAD, 1,              // 51
+    VM::GLOAD, 0,              // 53
+    VM::ALOAD,                 // 55
+    VM::IADD,                  // 56
+    VM::GSTORE, 2,             // 57
+    VM::GLOAD, 0,              // 59
+    VM::ICONST, 1,             // 61
+    VM::IADD,                  // 63
+    VM::GSTORE, 0,             // 64
+    VM::BR, 41,                // 66
+    // DONE (68): PRINT SUM
+    VM::GLOAD, 2,              // 68
+    VM::PRINT,                 // 70
+    VM::HALT                   // 71
+};
+
+// Vector benchmarks: the same work over 256 globals, once with the vector
+// opcodes and once as the equivalent unrolled scalar bytecode.
+// .GLOBALS 784; I at 0, A at 16, B at 272, C at 528
+
+#define VEC_N       256
+#define VEC_A       16
+#define VEC_B       272
+#define VEC_C       528
+#define VEC_REPEAT  1000
+
+#define SUM1(x)     VM::GLOAD, (x), VM::IADD
+#define SUM4(x)     SUM1(x), SUM1((x) + 1), SUM1((x) + 2), SUM1((x) + 3)
+#define SUM16(x)    SUM4(x), SUM4((x) + 4), SUM4((x) + 8), SUM4((x) + 12)
+#define SUM64(x)    SUM16(x), SUM16((x) + 16), SUM16((x) + 32), SUM16((x) + 48)
+#define SUM256(x)   SUM64(x), SUM64((x) + 64), SUM64((x) + 128), SUM64((x) + 192)
+
+#define ADD1(i)     VM::GLOAD, VEC_A + (i), VM::GLOAD, VEC_B + (i), VM::IADD, VM::GSTORE, VEC_C + (i)
+#define ADD4(i)     ADD1(i), ADD1((i) + 1), ADD1((i) + 2), ADD1((i) + 3)
+#define ADD16(i)    ADD4(i), ADD4((i) + 4), ADD4((i) + 8), ADD4((i) + 12)
+#define ADD64(i)    ADD16(i), ADD16((i) + 16), ADD16((i) + 32), ADD16((i) + 48)
+#define ADD256(i)   ADD64(i), ADD64((i) + 64), ADD64((i) + 128), ADD64((i) + 192)
+
+int vsum[] = {
+    // FOR I = 0; I < VEC_REPEAT: SUM(A)
+    VM::ICONST, 0,             // 0
+    VM::GSTORE, 0,             // 2
+    // START (4):
+    VM::GLOAD, 0,              // 4
+    VM::ICONST, VEC_REPEAT,    // 6
+    VM::ILT,                   // 8
+    VM::BRF, 26,               // 9
+    VM::ICONST, VEC_A,         // 11
+    VM::ICONST, VEC_N,         // 13
+    VM::VSUM,                  // 15
+    VM::POP,                   // 16
+    VM::GLOAD, 0,              // 17
+    VM::ICONST, 1,             // 19
+    VM::IADD,                  // 21
+    VM::GSTORE, 0,             // 22
+    VM::BR, 4,                 // 24
+    // DONE (26):
+    VM::HALT                   // 26
+};
+
+int ssum[] = {
+    VM::ICONST, 0,             // 0
+    VM::GSTORE, 0,             // 2
+    // START (4):
+    VM::GLOAD, 0,              // 4
+    VM::ICONST, VEC_REPEAT,    // 6
+    VM::ILT,                   // 8
+    VM::BRF, 13 + 3 * VEC_N + 10,
+    VM::ICONST, 0,             // 11
+    SUM256(VEC_A),             // 13
+    VM::POP,
+    VM::GLOAD, 0,
+    VM::ICONST, 1,
+    VM::IADD,
+    VM::GSTORE, 0,
+    VM::BR, 4,
+    // DONE (13 + 3 * VEC_N + 10):
+    VM::HALT
+};
+
+int vadd[] = {
+    // FOR I = 0; I < VEC_REPEAT: C = A + B
+    VM::ICONST, 0,             // 0
+    VM::GSTORE, 0,             // 2
+    // START (4):
+    VM::GLOAD, 0,              // 4
+    VM::ICONST, VEC_REPEAT,    // 6
+    VM::ILT,                   // 8
+    VM::BRF, 29,               // 9
+    VM::ICONST, VEC_C,         // 11
+    VM::ICONST, VEC_A,         // 13
+    VM::ICONST, VEC_B,         // 15
+    VM::ICONST, VEC_N,         // 17
+    VM::VADD,                  // 19
+    VM::GLOAD, 0,              // 20
+    VM::ICONST, 1,             // 22
+    VM::IADD,                  // 24
+    VM::GSTORE, 0,             // 25
+    VM::BR, 4,                 // 27
+    // DONE (29):
+    VM::HALT                   // 29
+};
+
+int sadd[] = {
+    VM::ICONST, 0,             // 0
+    VM::GSTORE, 0,             // 2
+    // START (4):
+    VM::GLOAD, 0,              // 4
+    VM::ICONST, VEC_REPEAT,    // 6
+    VM::ILT,                   // 8
+    VM::BRF, 11 + 7 * VEC_N + 9,
+    ADD256(0),                 // 11
+    VM::GLOAD, 0,
+    VM::ICONST, 1,
+    VM::IADD,
+    VM::GSTORE, 0,
+    VM::BR, 4,
+    // DONE (11 + 7 * VEC_N + 9):
+    VM::HALT
+};
+
+// Call round-trip benchmarks: the same loop with a native call, a bytecode
+// call and no call at all, so the difference is the cost of one call.
+// .GLOBALS 1; I
+
+int ncall[] = {
+    VM::ICONST, 0,             // 0
+    VM::GSTORE, 0,             // 2
+    // START (4):
+    VM::GLOAD, 0,              // 4
+    VM::ICONST, CALL_REPEAT,   // 6
+    VM::ILT,                   // 8
+    VM::BRF, 26,               // 9
+    VM::ICONST, 7,             // 11
+    VM::NCALL, NATIVE_HASH32, 1,    // 13
+    VM::POP,                   // 16
+    VM::GLOAD, 0,              // 17
+    VM::ICONST, 1,             // 19
+    VM::IADD,                  // 21
+    VM::GSTORE, 0,             // 22
+    VM::BR, 4,                 // 24
+    // DONE (26):
+    VM::HALT                   // 26
+};
+
+int bcall[] = {
+    //.def identity: ARGS=1, LOCALS=0
+    VM::LOAD, 0,               // 0
+    VM::RET,                   // 2
+    //.DEF MAIN                   <-- MAIN METHOD!
+    VM::ICONST, 0,             // 3
+    VM::GSTORE, 0,             // 5
+    // START (7):
+    VM::GLOAD, 0,              // 7
+    VM::ICONST, CALL_REPEAT,   // 9
+    VM::ILT,                   // 11
+    VM::BRF, 30,               // 12
+    VM::ICONST, 7,             // 14
+    VM::CALL, 0, 1, 0,         // 16
+    VM::POP,                   // 20
+    VM::GLOAD, 0,              // 21
+    VM::ICONST, 1,             // 23
+    VM::IADD,                  // 25
+    VM::GSTORE, 0,             // 26
+    VM::BR, 7,                 // 28
+    // DONE (30):
+    VM::HALT                   // 30
+};
+
+int nocall[] = {
+    VM::ICONST, 0,             // 0
+    VM::GSTORE, 0,             // 2
+    // START (4):
+    VM::GLOAD, 0,              // 4
+    VM::ICONST, CALL_REPEAT,   // 6
+    VM::ILT,                   // 8
+    VM::BRF, 23,               // 9
+    VM::ICONST, 7,             // 11
+    VM::POP,                   // 13
+    VM::GLOAD, 0,              // 14
+    VM::ICONST, 1,             // 16
+    VM::IADD,                  // 18
+    VM::GSTORE, 0,             // 19
+    VM::BR, 4,                 // 21
+    // DONE (23):
+    VM::HALT                   // 23
+};
+
+// Never terminates; only an instruction limit stops it
+int spin[] = {
+    VM::BR, 0                  // 0
+};
+
+const VM_PROGRAM vm_programs[] = {
+    { "hello",      "Hello Program",        hello,      sizeof(hello),      0, 0 },
+    { "loop",       "Loop Program",         loop,       sizeof(loop),       2, 0 },
+    { "factorial",  "Factorial Program",    factorial,  sizeof(factorial),  0, 23 },
+    { "arrays",     "Arrays Program",       arrays,     sizeof(arrays),     1, 0 },
+    { "natives",    "Natives Program",      natives,    sizeof(natives),    0, 0 },
+    { "churn",      "Churn Benchmark",      churn,      sizeof(churn),      1, 0 },
+    { "retain",     "Retain Benchmark",     retain,     sizeof(retain),     2, 0 },
+    { "fill",       "Fill Benchmark",       fill,       sizeof(fill),       3, 0 },
+    { "vsum",       "Vector Sum Benchmark", vsum,       sizeof(vsum),       VEC_C + VEC_N, 0 },
+    { "ssum",       "Scalar Sum Benchmark", ssum,       sizeof(ssum),       VEC_C + VEC_N, 0 },
+    { "vadd",       "Vector Add Benchmark", vadd,       sizeof(vadd),       VEC_C + VEC_N, 0 },
+    { "sadd",       "Scalar Add Benchmark", sadd,       sizeof(sadd),       VEC_C + VEC_N, 0 },
+    { "ncall",      "Native Call Benchmark",    ncall,  sizeof(ncall),      1, 0 },
+    { "bcall",      "Bytecode Call Benchmark",  bcall,  sizeof(bcall),      1, 3 },
+    { "nocall",     "No Call Benchmark",        nocall, sizeof(nocall),     1, 0 },
+    { "spin",       "Runaway Program",      spin,       sizeof(spin),       0, 0 },
+};
+
+const int vm_program_count = sizeof(vm_programs) / sizeof(VM_PROGRAM);
+
+const VM_PROGRAM *find_program(const char *name)
+{
+    for (int i = 0; i < vm_program_count; i++) {
+        if (strcmp(vm_programs[i].name, name) == 0) {
+            return &vm_programs[i];
+        }
+    }
+    return nullptr;
+}
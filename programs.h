@@ -0,0 +1,23 @@
+#ifndef PROGRAMS_H
+#define PROGRAMS_H
+
+// iterations of the loops in the ncall/bcall/nocall benchmarks; the runner
+// divides by it to get the cost of one call
+#define CALL_REPEAT 100000
+
+typedef struct {
+    const char *name;
+    const char *title;
+    int *code;
+    int code_size;      // in bytes
+    int nglobals;
+    int startip;
+} VM_PROGRAM;
+
+// Built-in programs shown in the GUI and run by the benchmarks
+extern const VM_PROGRAM vm_programs[];
+extern const int vm_program_count;
+
+const VM_PROGRAM *find_program(const char *name);
+
+#endif // PROGRAMS_H
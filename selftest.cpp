@@ -0,0 +1,295 @@
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include "programs.h"
+#include "selftest.h"
+#include "vm.h"
+#include "vmcodecache.h"
+#include "vmsnapshot.h"
+
+#define SELFTEST_LIMIT  100000000   // instructions; a check that runs away traps
+
+// Programs whose results the checks know
+static const char *equivalence_programs[] = {
+    "loop", "factorial", "arrays", "natives", "retain", "vsum", "sadd", "bcall"
+};
+
+static int gc_roots[] = {
+    // .GLOBALS 5
+    // G0 = NEW INT[3]; G0[1] = 42; a NEW INT[5] stays on the stack while
+    // F(), with a NEW INT[7] in a local, allocates enough garbage for many
+    // collections. G2 = G0[1], G3 = length of the stack array, G4 = F()
+    VM::ICONST, 3,             // 0
+    VM::NEWARR,                // 2
+    VM::GSTORE, 0,             // 3
+    VM::GLOAD, 0,              // 5
+    VM::ICONST, 1,             // 7
+    VM::ICONST, 42,            // 9
+    VM::ASTORE,                // 11
+    VM::ICONST, 5,             // 12
+    VM::NEWARR,                // 14
+    VM::CALL, 32, 0, 1,        // 15
+    VM::GSTORE, 4,             // 19
+    VM::ALEN,                  // 21
+    VM::GSTORE, 3,             // 22
+    VM::GLOAD, 0,              // 24
+    VM::ICONST, 1,             // 26
+    VM::ALOAD,                 // 28
+    VM::GSTORE, 2,             // 29
+    VM::HALT,                  // 31
+    // F (32): L0 = NEW INT[7]; FOR G1 = 200; G1; G1--: NEW INT[30000]
+    VM::ICONST, 7,             // 32
+    VM::NEWARR,                // 34
+    VM::STORE, 0,              // 35
+    VM::ICONST, 200,           // 37
+    VM::GSTORE, 1,             // 39
+    VM::GLOAD, 1,              // 41
+    VM::BRF, 58,               // 43
+    VM::ICONST, 30000,         // 45
+    VM::NEWARR,                // 47
+    VM::POP,                   // 48
+    VM::GLOAD, 1,              // 49
+    VM::ICONST, 1,             // 51
+    VM::ISUB,                  // 53
+    VM::GSTORE, 1,             // 54
+    VM::BR, 41,                // 56
+    VM::LOAD, 0,               // 58
+    VM::ALEN,                  // 60
+    VM::RET                    // 61
+};
+
+#ifdef __linux__
+// endless recursion, and endless pushes
+static int deep_calls[] = { VM::CALL, 0, 0, 0 };
+static int deep_pushes[] = { VM::ICONST, 1, VM::ICONST, 2, VM::ICONST, 3, VM::BR, 0 };
+#endif
+
+static int failures = 0;
+
+static bool check(const char *test, bool ok, const char *what)
+{
+    if (!ok) {
+        printf("%s: FAILED: %s\n", test, what);
+        failures++;
+    }
+    return ok;
+}
+
+static bool same_globals(const VM *a, const VM *b)
+{
+    return a->nglobals == b->nglobals
+           && memcmp(a->globals, b->globals, (size_t)a->nglobals * sizeof(int)) == 0;
+}
+
+// Collects what a program prints, one line per value
+static void capture_output(VM *vm, QString *output)
+{
+    QObject::connect(vm, &VM::hasStdout, [output](QString txt) {
+        *output += txt;
+        *output += "\n";
+    });
+}
+
+static VM::VM_STATE run_program(VM *vm)
+{
+    vm->set_instruction_limit(SELFTEST_LIMIT);
+    return vm->run_slice(LLONG_MAX);
+}
+
+// References in globals, on the operand stack and in locals all survive a
+// collection, and still point at their own arrays afterwards
+static void test_gc_roots()
+{
+    const char *test = "gc-roots";
+    int before = failures;
+
+    VM vm(gc_roots, sizeof(gc_roots), 5, 0);
+    check(test, run_program(&vm) == VM::VM_FINISHED, "program did not finish");
+    check(test, vm.heap_stats().collections > 0, "no collection ran");
+    check(test, vm.globals[2] == 42, "array in a global lost its contents");
+    check(test, vm.globals[3] == 5, "array on the stack lost its length");
+    check(test, vm.globals[4] == 7, "array in a local lost its length");
+    if (failures == before) printf("%s: ok\n", test);
+}
+
+// Inlined programs, static and profiled, print the same and end in the
+// same state as the program as written
+static void test_inliner()
+{
+    const char *test = "inliner";
+    int before = failures;
+    int sites = 0;
+
+    for (const char *name : equivalence_programs) {
+        const VM_PROGRAM *prog = find_program(name);
+        if (!check(test, prog != nullptr, name)) continue;
+
+        QString expected_output;
+        VM plain(prog->code, prog->code_size, prog->nglobals, prog->startip);
+        plain.set_inlining(VM::INLINE_OFF);
+        capture_output(&plain, &expected_output);
+        VM::VM_STATE expected = run_program(&plain);
+        check(test, expected == VM::VM_FINISHED, name);
+
+        VM::INLINE_MODE modes[] = { VM::INLINE_STATIC, VM::INLINE_PROFILE };
+        for (VM::INLINE_MODE mode : modes) {
+            QString output;
+            VM inlined(prog->code, prog->code_size, prog->nglobals, prog->startip);
+            inlined.set_inlining(mode);
+            capture_output(&inlined, &output);
+            check(test, run_program(&inlined) == expected && same_globals(&plain, &inlined), name);
+            check(test, output == expected_output, name);
+            sites += inlined.inline_stats().sites;
+        }
+    }
+    check(test, sites > 0, "nothing was inlined");
+    if (failures == before) printf("%s: ok\n", test);
+}
+
+// A run saved halfway, serialized and restored into a new VM ends where the
+// run without a break does, inlined code, heap and retired count included
+static void test_snapshot()
+{
+    const char *test = "snapshot";
+    int before = failures;
+    const char *names[] = { "retain", "bcall" };
+
+    for (const char *name : names) {
+        const VM_PROGRAM *prog = find_program(name);
+        if (!check(test, prog != nullptr, name)) continue;
+
+        VM whole(prog->code, prog->code_size, prog->nglobals, prog->startip);
+        whole.set_inlining(VM::INLINE_STATIC);
+        run_program(&whole);
+
+        VM first(prog->code, prog->code_size, prog->nglobals, prog->startip);
+        first.set_inlining(VM::INLINE_STATIC);
+        first.set_instruction_limit(SELFTEST_LIMIT);
+        check(test, first.run_slice(whole.instructions_retired() / 2) == VM::VM_SUSPENDED, name);
+
+        VMSnapshot taken;
+        VMSnapshot loaded;
+        check(test, first.snapshot(&taken), name);
+        check(test, loaded.deserialize(taken.serialize()), name);
+
+        // the snapshot brings its code, whatever this VM would inline
+        VM second(prog->code, prog->code_size, prog->nglobals, prog->startip);
+        second.set_inlining(VM::INLINE_OFF);
+        if (!check(test, second.restore(&loaded), name)) continue;
+        check(test, second.run_slice(LLONG_MAX) == VM::VM_FINISHED, name);
+        check(test, same_globals(&whole, &second), name);
+        check(test, second.instructions_retired() == whole.instructions_retired(), name);
+    }
+
+    // and only into the program it was taken from
+    const VM_PROGRAM *loop = find_program("loop");
+    const VM_PROGRAM *factorial = find_program("factorial");
+    VM a(loop->code, loop->code_size, loop->nglobals, loop->startip);
+    a.run_slice(20);
+    VMSnapshot snap;
+    a.snapshot(&snap);
+    VM b(factorial->code, factorial->code_size, factorial->nglobals, factorial->startip);
+    check(test, !b.restore(&snap), "restored into another program");
+    if (failures == before) printf("%s: ok\n", test);
+}
+
+// Overflowing either stack traps the VM, and the process carries on
+static void test_guard_pages()
+{
+    const char *test = "guard-pages";
+#ifdef __linux__
+    int before = failures;
+
+    for (int round = 0; round < 2; round++) {
+        VM calls(deep_calls, sizeof(deep_calls), 0, 0);
+        check(test, run_program(&calls) == VM::VM_TRAPPED, "call stack overflow did not trap");
+        VM pushes(deep_pushes, sizeof(deep_pushes), 0, 0);
+        check(test, run_program(&pushes) == VM::VM_TRAPPED, "operand stack overflow did not trap");
+    }
+    const VM_PROGRAM *prog = find_program("factorial");
+    VM after(prog->code, prog->code_size, prog->nglobals, prog->startip);
+    check(test, run_program(&after) == VM::VM_FINISHED, "a VM after the traps did not finish");
+    if (failures == before) printf("%s: ok\n", test);
+#else
+    printf("%s: skipped, no guard pages on this platform\n", test);
+#endif
+}
+
+static CODE_CACHE_STATS cached_run(const QString &dir, const VM_PROGRAM *prog, const VMNatives *natives,
+                                   VM::VM_STATE *state, int *result)
+{
+    VMCodeCache cache(dir);
+    VM vm(prog->code, prog->code_size, prog->nglobals, prog->startip);
+    vm.set_inlining(VM::INLINE_STATIC);
+    vm.set_natives(natives);
+    vm.set_code_cache(&cache);
+    *state = run_program(&vm);
+    *result = vm.nglobals > 0 ? vm.globals[0] : 0;
+    return cache.stats();
+}
+
+// A damaged entry is dropped and the program still runs right; a different
+// native table does not hit the entry of another one
+static void test_code_cache()
+{
+    const char *test = "code-cache";
+    int before = failures;
+    QString dir = QDir::temp().filePath(QString("vm-selftest-%1").arg(QCoreApplication::applicationPid()));
+    const VM_PROGRAM *prog = find_program("bcall");
+    VM::VM_STATE state;
+    int result;
+
+    QDir(dir).removeRecursively();
+    CODE_CACHE_STATS stats = cached_run(dir, prog, VMNatives::standard(), &state, &result);
+    check(test, stats.misses == 1 && stats.stores == 1, "first run was not stored");
+    int expected = result;
+
+    stats = cached_run(dir, prog, VMNatives::standard(), &state, &result);
+    check(test, stats.hits == 1 && state == VM::VM_FINISHED && result == expected, "second run missed");
+
+    // flip a bit of the cost table, at the end of the entry
+    QStringList entries = QDir(dir).entryList(QDir::Files);
+    check(test, entries.size() == 1, "expected exactly one entry");
+    for (const QString &entry : entries) {
+        QFile file(QDir(dir).filePath(entry));
+        if (!check(test, file.open(QIODevice::ReadWrite), "cannot open the entry")) continue;
+        QByteArray data = file.readAll();
+        data[data.size() - 1] = data[data.size() - 1] ^ 1;
+        file.seek(0);
+        file.write(data);
+        file.close();
+    }
+    stats = cached_run(dir, prog, VMNatives::standard(), &state, &result);
+    check(test, stats.rejected == 1 && stats.hits == 0, "damaged entry was not rejected");
+    check(test, state == VM::VM_FINISHED && result == expected, "wrong result after a rejected entry");
+
+    // loop makes no native calls, so it verifies against either table
+    const VM_PROGRAM *loop = find_program("loop");
+    VMNatives other;
+    other.set_pure(true);
+    cached_run(dir, loop, VMNatives::standard(), &state, &result);
+    stats = cached_run(dir, loop, &other, &state, &result);
+    check(test, stats.hits == 0 && stats.misses == 1, "another native table hit the entry");
+
+    QDir(dir).removeRecursively();
+    if (failures == before) printf("%s: ok\n", test);
+}
+
+int run_selftest()
+{
+    test_gc_roots();
+    test_inliner();
+    test_snapshot();
+    test_guard_pages();
+    test_code_cache();
+
+    if (failures > 0) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
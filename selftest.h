@@ -0,0 +1,9 @@
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+// vm --selftest: headless regression checks of the collector's roots, the
+// inliner, snapshots, the stack guard pages and the code cache. Prints one
+// line per check and returns 0 if all of them pass.
+int run_selftest();
+
+#endif // SELFTEST_H
@@ -1,6 +1,22 @@
 #include <QDebug>
+#include <QElapsedTimer>
+
+#include <limits.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "vm.h"
+#include "vmcodecache.h"
+#include "vminline.h"
+#include "vmsimd.h"
+#include "vmsnapshot.h"
 
 typedef struct {
     char name[8];
@@ -26,29 +42,422 @@ static VM_INSTRUCTION vm_instructions[] = {
     { "pop",    0 },
     { "call",   3 },
     { "ret",    0 },
-    { "halt",   0 }
+    { "halt",   0 },
+    { "gsync",  0 },
+    { "newarr", 0 },
+    { "aload",  0 },
+    { "astore", 0 },
+    { "alen",   0 },
+    { "vadd",   0 },
+    { "vmul",   0 },
+    { "vsum",   0 },
+    { "vmin",   0 },
+    { "vmax",   0 },
+    { "vfill",  0 },
+    { "vcopy",  0 },
+    { "ncall",  2 }
+};
+
+#define VM_NUM_INSTRUCTIONS (int)(sizeof(vm_instructions) / sizeof(VM_INSTRUCTION))
+
+static VM::INLINE_MODE default_inline_mode()
+{
+    const char *mode = getenv("VM_INLINE");
+
+    if (mode && strcmp(mode, "static") == 0) return VM::INLINE_STATIC;
+    if (mode && strcmp(mode, "profile") == 0) return VM::INLINE_PROFILE;
+    return VM::INLINE_OFF;
+}
+
+// Instructions that end a straight-line run of code
+#define IS_CONTROL(op) ((op) == VM::BR || (op) == VM::BRT || (op) == VM::BRF \
+                        || (op) == VM::CALL || (op) == VM::RET || (op) == VM::HALT)
+
+// The dispatch loop keeps ip, sp and callsp in locals and stores them into
+// the VM where something else reads them: pause, exit, the collector, and
+// here on entry to every run, which is where overflow recovery starts from
+#define SAVE_REGISTERS(at) \
+    this->ip = (at); \
+    this->sp = sp; \
+    this->callsp = callsp;
+
+// Fuel is charged when control enters a run, for the whole run at once, so
+// metering adds nothing to straight-line instructions. Running dry sets a
+// flag of the dispatch loop, apart from shouldHalt, so a halt() that comes
+// in during the last run of a slice is not mistaken for it.
+#define CHARGE_RUN() \
+    SAVE_REGISTERS(ip); \
+    if ((this->fuel -= cost[ip]) < 0) { \
+        out_of_fuel = true; \
+    }
+
+// Ranges that share some but not all elements; kernels read and write in
+// different orders, so only identical or disjoint ranges are well defined
+#define PARTIAL_OVERLAP(x, y, n) ((x) != (y) && (qint64)(x) < (qint64)(y) + (n) && (qint64)(y) < (qint64)(x) + (n))
+
+#define GUARD_OPERAND_STACK 1
+#define GUARD_CALL_STACK    2
+
+// Fills unused stack slots; a return address is never negative
+#define STACK_PAINT         ((int)0xdeadbeef)
+
+#ifdef __linux__
+// Set once by VMStackGuard::install(); sysconf() is not async-signal-safe,
+// so the SIGSEGV handler reads it from here
+static size_t page_size = 0;
+
+// Maps bytes so that they end exactly at a PROT_NONE page; returns the start
+// and sets *guard to the guard page
+static void *map_guarded(size_t bytes, char **guard)
+{
+    size_t page = page_size;
+    size_t usable = (bytes + page - 1) / page * page;
+
+    char *base = (char *)mmap(nullptr, usable + page, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+    if (mprotect(base + usable, page, PROT_NONE) != 0) {
+        munmap(base, usable + page);
+        return nullptr;
+    }
+    *guard = base + usable;
+    return *guard - bytes;
+}
+
+static void unmap_guarded(size_t bytes, char *guard)
+{
+    size_t page = page_size;
+    size_t usable = (bytes + page - 1) / page * page;
+    munmap(guard - usable, usable + page);
+}
+
+// VM whose dispatch loop runs on this thread, for the SIGSEGV handler
+static thread_local VM *guarded_vm = nullptr;
+
+class VMStackGuard
+{
+public:
+    static void install()
+    {
+        page_size = sysconf(_SC_PAGESIZE);
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = handler;
+        sigemptyset(&action.sa_mask);
+        // not blocked in the handler, so leaving it with siglongjmp needs
+        // no signal mask restore and sigsetjmp() stays a plain call
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigaction(SIGSEGV, &action, &previous);
+    }
+
+private:
+    static void handler(int sig, siginfo_t *info, void *context)
+    {
+        VM *vm = guarded_vm;
+        if (vm) {
+            char *addr = (char *)info->si_addr;
+            if (vm->stack_guard && addr >= vm->stack_guard && addr < vm->stack_guard + page_size) {
+                siglongjmp(vm->guard_jump, GUARD_OPERAND_STACK);
+            }
+            if (vm->call_guard && addr >= vm->call_guard && addr < vm->call_guard + page_size) {
+                siglongjmp(vm->guard_jump, GUARD_CALL_STACK);
+            }
+        }
+
+        // not a stack overflow: pass it on to the handler saved at install
+        // time, which stays in place for the next fault
+        if (previous.sa_flags & SA_SIGINFO) {
+            previous.sa_sigaction(sig, info, context);
+            return;
+        }
+        if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+            previous.sa_handler(sig);
+            return;
+        }
+        if (previous.sa_handler == SIG_IGN && info->si_code <= 0) {
+            return;     // sent with kill() or the like, not a fault
+        }
+
+        // The default action cannot be called: take it for this signal and
+        // raise it again. SIGSEGV is not blocked in here, so that ends the
+        // process on the spot and the changed disposition is never seen.
+        struct sigaction dfl;
+        memset(&dfl, 0, sizeof(dfl));
+        dfl.sa_handler = SIG_DFL;
+        sigemptyset(&dfl.sa_mask);
+        sigaction(sig, &dfl, nullptr);
+        raise(sig);
+    }
+
+    static struct sigaction previous;
 };
 
-VM::VM(int *code, int code_size, int nglobals, int startip, QObject *parent) : QThread(parent), startip(startip)
+struct sigaction VMStackGuard::previous;
+#endif
+
+VM::VM(int *code, int code_size, qint64 nglobals, int startip, QObject *parent) : QThread(parent), startip(startip), restored(false)
 {
     init(code, code_size, nglobals);
+    alloc_stacks();
 }
 
-void VM::init(int *code, int code_size, int nglobals)
+void VM::init(int *code, int code_size, qint64 nglobals)
 {
     this->code = code;
     this->code_size = code_size;
+    this->source_code = code;
+    this->source_size = code_size;
     this->globals = (int *)calloc(nglobals, sizeof(int));
     this->nglobals = nglobals;
+    this->globals_mapped = false;
+    this->globals_fd = -1;
+    this->global_tags.reset(nglobals);
+    this->natives = VMNatives::standard();
+
+    this->ip = startip;
+    this->sp = -1;
+    this->callsp = -1;
+
+    this->loaded = false;
+    this->costs = nullptr;
+    this->code_cache = nullptr;
+    this->state = VM_SUSPENDED;
+    this->fuel = 0;
+    this->retired = 0;
+    this->instruction_limit = 0;
+
+    this->inline_mode = default_inline_mode();
+    this->inlined = false;
+    this->inline_entry = 0;
+    memset(&this->inlining, 0, sizeof(this->inlining));
+    this->call_counts = nullptr;
+
+    this->calls = 0;
+    this->vector_dispatches = 0;
+    this->native_dispatches = 0;
+    this->paused_ns = 0;
+    this->metrics_retired = 0;
+    this->stack_high = 0;
+    this->call_high = 0;
+    this->hw_counters = false;
     
     // Initialize stack and pause control
     this->isPaused = false;
     this->shouldHalt = false;
+    this->atSafePoint = false;
 }
 
 VM::~VM()
 {
+    release_globals();
+    release_stacks();
+}
+
+void VM::alloc_stacks()
+{
+    this->stack = nullptr;
+    this->call_stack = nullptr;
+    this->stack_guard = nullptr;
+    this->call_guard = nullptr;
+
+#ifdef __linux__
+    static bool installed = (VMStackGuard::install(), true);
+    Q_UNUSED(installed);
+
+    this->stack = (int *)map_guarded(DEFAULT_STACK_SIZE * sizeof(int), &this->stack_guard);
+    this->call_stack = (Context *)map_guarded(DEFAULT_CALL_STACK_SIZE * sizeof(Context), &this->call_guard);
+#endif
+    // unprotected fallback
+    if (!this->stack) {
+        this->stack_guard = nullptr;
+        this->stack = (int *)calloc(DEFAULT_STACK_SIZE, sizeof(int));
+    }
+    if (!this->call_stack) {
+        this->call_guard = nullptr;
+        this->call_stack = (Context *)calloc(DEFAULT_CALL_STACK_SIZE, sizeof(Context));
+    }
+
+    for (int i = 0; i < DEFAULT_STACK_SIZE; i++) {
+        this->stack[i] = STACK_PAINT;
+    }
+    for (int i = 0; i < DEFAULT_CALL_STACK_SIZE; i++) {
+        this->call_stack[i].returnip = STACK_PAINT;
+    }
+}
+
+void VM::release_stacks()
+{
+#ifdef __linux__
+    if (this->stack_guard) {
+        unmap_guarded(DEFAULT_STACK_SIZE * sizeof(int), this->stack_guard);
+    } else
+#endif
+    free(this->stack);
+
+#ifdef __linux__
+    if (this->call_guard) {
+        unmap_guarded(DEFAULT_CALL_STACK_SIZE * sizeof(Context), this->call_guard);
+    } else
+#endif
+    free(this->call_stack);
+
+    this->stack = nullptr;
+    this->call_stack = nullptr;
+}
+
+// Net change of sp by a straight-line instruction other than NCALL
+static int stack_effect(int opcode)
+{
+    switch (opcode) {
+    case VM::ICONST:
+    case VM::LOAD:
+    case VM::GLOAD:
+        return 1;
+    case VM::NOOP:
+    case VM::NEWARR:
+    case VM::ALEN:
+    case VM::GSYNC:
+        return 0;
+    case VM::ASTORE:
+    case VM::VFILL:
+    case VM::VCOPY:
+        return -3;
+    case VM::VADD:
+    case VM::VMUL:
+        return -4;
+    default:
+        return -1;
+    }
+}
+
+// Called after a push or CALL ran into a guard page. The registers hold what
+// the dispatch loop last stored: a CALL stores its own address before it
+// pushes a context, otherwise they hold an instruction of the current run,
+// and replaying stack effects from there finds the push that overflowed.
+void VM::stack_overflow(int which)
+{
+    char msg[128];
+    int at = this->ip;
+
+    if (which == GUARD_OPERAND_STACK) {
+        int depth = this->sp;
+        while (at < this->code_size) {
+            int opcode = this->code[at];
+            if (opcode == NCALL) {
+                const VM_NATIVE_ENTRY *fn = this->natives->at(this->code[at + 1]);
+                depth += fn->nresults - fn->nargs;
+            } else {
+                depth += stack_effect(opcode);
+            }
+            if (depth >= DEFAULT_STACK_SIZE || IS_CONTROL(opcode)) break;
+            at += instruction_size(opcode);
+        }
+        this->sp = DEFAULT_STACK_SIZE - 1;
+        snprintf(msg, sizeof(msg), "operand stack overflow (stack depth %d, call depth %d)",
+                 this->sp + 1, this->callsp + 1);
+    } else {
+        this->callsp = DEFAULT_CALL_STACK_SIZE - 1;
+        snprintf(msg, sizeof(msg), "call stack overflow (stack depth %d, call depth %d)",
+                 this->sp + 1, this->callsp + 1);
+    }
+    this->ip = at;
+    trap(at, msg);
+}
+
+void VM::release_globals()
+{
+#ifdef __linux__
+    if (this->globals_mapped) {
+        munmap(this->globals, (size_t)this->nglobals * sizeof(int));
+    } else
+#endif
     free(this->globals);
+#ifdef __linux__
+    if (this->globals_fd >= 0) close(this->globals_fd);
+#endif
+
+    this->globals = nullptr;
+    this->global_tags.reset(0);
+    this->globals_mapped = false;
+    this->globals_fd = -1;
+}
+
+bool VM::map_globals_file(const QString &path, qint64 nglobals, GLOBALS_ACCESS access)
+{
+#ifdef __linux__
+    int fd = open(path.toLocal8Bit().constData(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "cannot open globals file: %s\n", path.toLocal8Bit().constData());
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    if (nglobals <= 0) {
+        nglobals = st.st_size / (qint64)sizeof(int);
+    }
+    size_t bytes = (size_t)nglobals * sizeof(int);
+
+    // grow the file sparsely; untouched pages never hit the disk
+    if ((qint64)bytes > (qint64)st.st_size && ftruncate(fd, bytes) != 0) {
+        fprintf(stderr, "cannot resize globals file to %lld globals\n", nglobals);
+        close(fd);
+        return false;
+    }
+    if (bytes == 0) {
+        close(fd);
+        fprintf(stderr, "empty globals file: %s\n", path.toLocal8Bit().constData());
+        return false;
+    }
+
+    void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        close(fd);
+        fprintf(stderr, "cannot map globals file: %s\n", path.toLocal8Bit().constData());
+        return false;
+    }
+
+    switch (access) {
+    case GLOBALS_SEQUENTIAL:
+        madvise(p, bytes, MADV_SEQUENTIAL);
+        break;
+    case GLOBALS_RANDOM:
+        madvise(p, bytes, MADV_RANDOM);
+        break;
+    case GLOBALS_NORMAL:
+        break;
+    }
+
+    release_globals();
+    this->globals = (int *)p;
+    this->nglobals = nglobals;
+    this->global_tags.reset(nglobals);
+    this->globals_mapped = true;
+    this->globals_fd = fd;  // kept for copy_globals()
+    return true;
+#else
+    (void)path;
+    (void)nglobals;
+    (void)access;
+    fprintf(stderr, "file-backed globals are not supported on this platform\n");
+    return false;
+#endif
+}
+
+bool VM::sync_globals()
+{
+#ifdef __linux__
+    if (this->globals_mapped && this->nglobals > 0) {
+        return msync(this->globals, (size_t)this->nglobals * sizeof(int), MS_SYNC) == 0;
+    }
+#endif
+    return true;
 }
 
 void VM::context_init(Context *ctx, int ip, int nlocals) {
@@ -56,93 +465,524 @@ void VM::context_init(Context *ctx, int ip, int nlocals) {
         fprintf(stderr, "too many locals requested: %d\n", nlocals);
     }
     ctx->returnip = ip;
+    memset(ctx->reftags, 0, sizeof(ctx->reftags));
+}
+
+void VM::trap(int ip, const char *msg)
+{
+    fprintf(stderr, "%s at ip=%d\n", msg, source_address(ip));
+    this->shouldHalt = true;
+    this->state = VM_TRAPPED;
+}
+
+void VM::collect_garbage(int need)
+{
+    // the reference tags make every root exact
+    QVector<int *> roots;
+    for (int i = 0; i <= this->sp; i++) {
+        if (this->stack_tags[i]) roots.append(&this->stack[i]);
+    }
+    for (int c = 0; c <= this->callsp; c++) {
+        for (int i = 0; i < DEFAULT_NUM_LOCALS; i++) {
+            if (this->call_stack[c].reftags[i]) roots.append(&this->call_stack[c].locals[i]);
+        }
+    }
+    this->global_tags.roots(this->globals, roots);
+    this->heap.collect(roots, need);
+}
+
+int VM::heap_alloc(int length)
+{
+    int ref = this->heap.alloc(length);
+    if (ref == 0) {
+        collect_garbage(length);
+        ref = this->heap.alloc(length);
+    }
+    return ref;
+}
+
+bool VM::global_range(qint64 base, qint64 len) const
+{
+    return base >= 0 && len >= 0 && base + len <= this->nglobals;
+}
+
+void VM::clear_global_tags(qint64 base, qint64 len)
+{
+    this->global_tags.clear(base, len);
+}
+
+void VM::set_natives(const VMNatives *natives)
+{
+    this->natives = natives;
+    this->loaded = false;
+}
+
+void VM::set_code_cache(VMCodeCache *cache)
+{
+    this->code_cache = cache;
+    this->loaded = false;
+}
+
+// Load-time check of the whole program, so the dispatch loop can trust it:
+// every instruction is known, every branch and call lands on an instruction
+// and every NCALL names a registered native with the arity it was
+// registered with.
+bool VM::verify_code() const
+{
+    int ncode = this->code_size / sizeof(int);
+    QVector<char> starts(ncode + 1, 0);
+
+    for (int i = 0; i < ncode; i += 1 + vm_instructions[this->code[i]].nargs) {
+        int opcode = this->code[i];
+        if (opcode < 0 || opcode >= VM_NUM_INSTRUCTIONS) {
+            fprintf(stderr, "invalid opcode: %d at ip=%d\n", opcode, i);
+            return false;
+        }
+        if (i + vm_instructions[opcode].nargs >= ncode) {
+            fprintf(stderr, "truncated %s at ip=%d\n", vm_instructions[opcode].name, i);
+            return false;
+        }
+        if (opcode == LOAD || opcode == STORE) {
+            int offset = this->code[i + 1];
+            if (offset < 0 || offset >= DEFAULT_NUM_LOCALS) {
+                fprintf(stderr, "local %d out of range at ip=%d\n", offset, i);
+                return false;
+            }
+        }
+        if (opcode == CALL) {
+            int nargs = this->code[i + 2];
+            int nlocals = this->code[i + 3];
+            if (nargs < 0 || nlocals < 0 || nargs + nlocals > DEFAULT_NUM_LOCALS) {
+                fprintf(stderr, "CALL with %d args and %d locals at ip=%d\n", nargs, nlocals, i);
+                return false;
+            }
+        }
+        if (opcode == NCALL) {
+            int fn = this->code[i + 1];
+            int nargs = this->code[i + 2];
+            if (!this->natives || fn < 0 || fn >= this->natives->count()) {
+                fprintf(stderr, "unknown native %d at ip=%d\n", fn, i);
+                return false;
+            }
+            if (nargs != this->natives->at(fn)->nargs) {
+                fprintf(stderr, "native %s takes %d args, called with %d at ip=%d\n",
+                        this->natives->at(fn)->name, this->natives->at(fn)->nargs, nargs, i);
+                return false;
+            }
+            // the result overwrites the first argument slot, there is one
+            if (this->natives->at(fn)->nresults < 0 || this->natives->at(fn)->nresults > 1) {
+                fprintf(stderr, "native %s returns %d results at ip=%d\n",
+                        this->natives->at(fn)->name, this->natives->at(fn)->nresults, i);
+                return false;
+            }
+        }
+        starts[i] = 1;
+    }
+
+    for (int i = 0; i < ncode; i += 1 + vm_instructions[this->code[i]].nargs) {
+        int opcode = this->code[i];
+        if (opcode == BR || opcode == BRT || opcode == BRF || opcode == CALL) {
+            int target = this->code[i + 1];
+            if (target < 0 || target >= ncode || !starts[target]) {
+                fprintf(stderr, "bad %s target %d at ip=%d\n", vm_instructions[opcode].name, target, i);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int VM::instruction_size(int opcode)
+{
+    return opcode >= 0 && opcode < VM_NUM_INSTRUCTIONS ? 1 + vm_instructions[opcode].nargs : 1;
+}
+
+void VM::set_inlining(INLINE_MODE mode)
+{
+    this->inline_mode = mode;
+}
+
+const INLINE_STATS &VM::inline_stats() const
+{
+    return this->inlining;
+}
+
+int VM::source_address(int addr) const
+{
+    if (!this->inlined || addr < 0 || addr >= this->origin.size()) {
+        return addr;
+    }
+    return this->origin[addr];
+}
+
+int VM::code_address(int source) const
+{
+    if (!this->inlined) {
+        return source;
+    }
+    if (source == this->startip) {
+        return this->inline_entry;
+    }
+    return source >= 0 && source < this->address_map.size() ? this->address_map[source] : -1;
+}
+
+// A private copy of the globals: a copy-on-write mapping of the file behind
+// file-backed globals, otherwise a plain copy. nullptr if out of memory.
+int *VM::copy_globals(bool *mapped) const
+{
+    size_t bytes = (size_t)this->nglobals * sizeof(int);
+
+    *mapped = false;
+#ifdef __linux__
+    if (this->globals_fd >= 0) {
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, this->globals_fd, 0);
+        if (p != MAP_FAILED) {
+            *mapped = true;
+            return (int *)p;
+        }
+    }
+#endif
+    int *globals = (int *)malloc(bytes > 0 ? bytes : 1);
+    if (globals) memcpy(globals, this->globals, bytes);
+    return globals;
+}
+
+// Call counts per CALL address from a short run of a scratch copy; it
+// stops early at an NCALL unless the natives are pure. The copy runs on a
+// private copy of the globals, so its branches go as the real run's will.
+QVector<qint64> VM::profile_calls() const
+{
+    QVector<qint64> counts(this->code_size / sizeof(int), 0);
+
+    bool mapped;
+    int *globals = copy_globals(&mapped);
+    if (!globals) {
+        return counts;
+    }
+    VM scratch(this->code, this->code_size, 0, this->startip);
+    scratch.release_globals();
+    scratch.globals = globals;
+    scratch.nglobals = this->nglobals;
+    scratch.globals_mapped = mapped;
+    scratch.global_tags.reset(this->nglobals);
+    scratch.set_natives(this->natives);
+    scratch.set_inlining(INLINE_OFF);
+    scratch.call_counts = counts.data();
+    scratch.run_slice(INLINE_PROFILE_FUEL);
+    return counts;
+}
+
+static QVector<int> to_vector(const int *words, int n)
+{
+    QVector<int> v(n);
+    memcpy(v.data(), words, n * sizeof(int));
+    return v;
+}
+
+// Swaps in the inlined program. Anything the inliner can't handle is left
+// as written; so is the program if the result fails verification.
+void VM::apply_inlining()
+{
+    // a restored run goes on in the code its snapshot was taken of
+    if (this->inlined || this->restored || this->inline_mode == INLINE_OFF) {
+        return;
+    }
+
+    VMInliner inliner(this->code, this->code_size / sizeof(int), this->startip);
+    if (this->inline_mode == INLINE_PROFILE) {
+        inliner.set_profile(profile_calls());
+    }
+    if (!inliner.run()) {
+        return;
+    }
+
+    this->inlined_code = inliner.code;
+    this->code = this->inlined_code.data();
+    this->code_size = this->inlined_code.size() * sizeof(int);
+    if (!verify_code()) {
+        fprintf(stderr, "inlined program failed verification, running it as written\n");
+        this->code = this->source_code;
+        this->code_size = this->source_size;
+        this->inlined_code.clear();
+        return;
+    }
+    use_inlined(inliner.origin, inliner.address_map, inliner.entry, inliner.stats);
+}
+
+// Runs the inlined program from now on; code already points at it
+void VM::use_inlined(const QVector<int> &origin, const QVector<int> &address_map, int entry,
+                     const INLINE_STATS &stats)
+{
+    this->origin = origin;
+    this->address_map = address_map;
+    this->inline_entry = entry;
+    this->inlining = stats;
+    this->inlined = true;
+    this->ip = code_address(this->ip);
+}
+
+// Verifies the program once per VM, inlines it if asked to, and computes,
+// for every instruction, the length of the straight-line run from it up to
+// the next control transfer. With a code cache, a program it has seen
+// before skips all of that, profiling included. Code installed by
+// restore() is already inlined and bypasses the cache.
+bool VM::load()
+{
+    if (this->loaded) {
+        return true;
+    }
+    bool cacheable = this->code_cache && !this->inlined;
+    if (cacheable) {
+        CODE_CACHE_ENTRY entry;
+        if (this->code_cache->lookup(this->code, this->code_size, this->natives, this->inline_mode, &entry)) {
+            if (entry.code) {
+                int nsource = this->code_size / sizeof(int);
+                this->inlined_code = to_vector(entry.code, entry.code_size / sizeof(int));
+                this->code = this->inlined_code.data();
+                this->code_size = entry.code_size;
+                use_inlined(to_vector(entry.origin, entry.code_size / sizeof(int)),
+                            to_vector(entry.address_map, nsource + 1), entry.entry, entry.inlining);
+            }
+            this->costs = entry.costs;
+            this->loaded = true;
+            return true;
+        }
+    }
+    if (!verify_code()) {
+        return false;
+    }
+    apply_inlining();
+
+    int ncode = this->code_size / sizeof(int);
+    QVector<int> starts;
+    for (int i = 0; i < ncode; i += 1 + vm_instructions[this->code[i]].nargs) {
+        starts.append(i);
+    }
+
+    // 0 marks the middle of an instruction
+    this->block_cost = QVector<int>(ncode + 1, 0);
+    int next = 0;
+    for (int k = starts.size() - 1; k >= 0; k--) {
+        int i = starts[k];
+        this->block_cost[i] = IS_CONTROL(this->code[i]) ? 1 : 1 + next;
+        next = this->block_cost[i];
+    }
+    this->costs = this->block_cost.constData();
+
+    if (cacheable) {
+        CODE_CACHE_ENTRY entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.costs = this->costs;
+        entry.code_size = this->code_size;
+        if (this->inlined) {
+            entry.code = this->code;
+            entry.origin = this->origin.constData();
+            entry.address_map = this->address_map.constData();
+            entry.entry = this->inline_entry;
+            entry.inlining = this->inlining;
+        }
+        this->code_cache->store(this->source_code, this->source_size, this->natives, this->inline_mode, &entry);
+    }
+    this->loaded = true;
+    return true;
+}
+
+void VM::set_instruction_limit(qint64 limit)
+{
+    this->instruction_limit = limit;
+}
+
+qint64 VM::instructions_retired() const
+{
+    return this->retired;
+}
+
+VM::VM_STATE VM::get_state() const
+{
+    return this->state;
+}
+
+VM::VM_STATE VM::run_slice(qint64 fuel)
+{
+    if (this->state != VM_SUSPENDED) {
+        return this->state;
+    }
+
+    if (this->instruction_limit > 0 && this->instruction_limit - this->retired < fuel) {
+        fuel = this->instruction_limit - this->retired;
+    }
+    this->fuel = fuel;
+    exec_resume(false);
+    return this->state;
+}
+
+VMMetrics &VM::metrics()
+{
+    return this->vm_metrics;
+}
+
+void VM::set_hardware_counters(bool enable)
+{
+    this->hw_counters = enable;
+}
+
+// Moves the counts gathered since the last call into the registry; running
+// is the part of the current slice charged so far
+void VM::flush_metrics(qint64 running)
+{
+    // a slot pushed with the paint value ends the scan early, rarely
+    while (this->stack_high < DEFAULT_STACK_SIZE && this->stack[this->stack_high] != STACK_PAINT) {
+        this->stack_high++;
+    }
+    while (this->call_high < DEFAULT_CALL_STACK_SIZE && this->call_stack[this->call_high].returnip != STACK_PAINT) {
+        this->call_high++;
+    }
+
+    this->vm_metrics.add(METRIC_RETIRED, this->retired + running - this->metrics_retired);
+    this->metrics_retired = this->retired + running;
+    this->vm_metrics.add(METRIC_CALLS, this->calls);
+    this->vm_metrics.add(METRIC_DISPATCH_VECTOR, this->vector_dispatches);
+    this->vm_metrics.add(METRIC_DISPATCH_NATIVE, this->native_dispatches);
+    this->vm_metrics.add(METRIC_PAUSED_NS, this->paused_ns);
+    this->vm_metrics.raise(METRIC_MAX_STACK_DEPTH, this->stack_high);
+    this->vm_metrics.raise(METRIC_MAX_CALL_DEPTH, this->call_high);
+
+    this->calls = 0;
+    this->vector_dispatches = 0;
+    this->native_dispatches = 0;
+    this->paused_ns = 0;
+}
+
+// Flushes and tells the GUI; it counts the steps it has drawn, so the
+// difference is how far the display lags behind
+void VM::post_metrics(qint64 running)
+{
+    qint64 values[METRIC_COUNT];
+
+    flush_metrics(running);
+    this->vm_metrics.add(METRIC_GUI_POSTED, 1);
+    this->vm_metrics.read(values);
+    this->vm_metrics.raise(METRIC_GUI_BACKLOG_MAX, values[METRIC_GUI_POSTED] - values[METRIC_GUI_DELIVERED]);
+    emit metricsChanged();
+}
+
+const HEAP_STATS &VM::heap_stats() const
+{
+    return this->heap.stats();
 }
 
 void VM::run()
 {
-    exec(startip, true);
+    if (this->restored) {
+        begin_run();
+        exec_resume(true);
+    } else {
+        exec(startip, true);
+    }
+}
+
+// A run to completion: fuel is whatever is left of the instruction limit,
+// and a halt or trap of an earlier run does not stop this one
+void VM::begin_run()
+{
+    this->state = VM_SUSPENDED;
+    this->shouldHalt = false;
+    this->fuel = this->instruction_limit > 0 ? this->instruction_limit - this->retired : LLONG_MAX;
 }
 
 void VM::exec(int startip, bool trace)
 {
-    // registers
-    int ip;         // instruction pointer register
-    int sp;         // stack pointer register
-    int callsp;     // call stack pointer register
+    this->ip = code_address(startip);
+    this->sp = -1;
+    this->callsp = -1;
+
+    begin_run();
+    exec_resume(trace);
+}
+
+// The dispatch loop of exec_resume(). It is a function of its own so that
+// its registers are not live across the sigsetjmp() there, which would keep
+// them out of machine registers. Returns true when it ran out of fuel.
+bool VM::dispatch(bool trace, qint64 budget)
+{
+    // registers, kept out of the VM while the loop runs so that stores
+    // through the stacks cannot alias them; see SAVE_REGISTERS
+    int ip = this->ip;
+    int sp = this->sp;
+    int callsp = this->callsp;
 
     int a = 0;
     int b = 0;
     int addr = 0;
     int offset = 0;
+    int len = 0;
 
-    ip = startip;
-    sp = -1;
-    callsp = -1;
-    
-    // Emit initial register values
-    emit ipChanged(ip);
-    emit spChanged(sp);
-    emit callSpChanged(callsp);
-    
-    // Check if starting IP is valid
-    if (ip < 0 || ip >= this->code_size) {
-        fprintf(stderr, "Invalid starting IP: %d (code size: %d)\n", ip, this->code_size);
-        return;
-    }
-    
-    int opcode = this->code[ip];
+    const VM_SIMD_KERNELS *simd = simd_kernels();
+    const int *cost = this->costs;
+    bool out_of_fuel = false;
 
-    // Initialize memory display at start
-    if (trace) print_data(this->globals, this->nglobals);
+    int opcode = this->code[ip];
 
-    while (opcode != HALT && ip >= 0 && ip < this->code_size && !this->shouldHalt) {
+    while (opcode != HALT && ip >= 0 && ip < this->code_size && !out_of_fuel && !this->shouldHalt) {
 
         // Check for pause state - wait while paused
         if (this->isPaused) {
+            SAVE_REGISTERS(ip);
+            this->atSafePoint = true;
+            QElapsedTimer paused;
+            paused.start();
             msleep(1000); // Wait while paused
+            this->paused_ns += paused.nsecsElapsed();
             continue;
         }
+        this->atSafePoint = false;
         
         if (trace) print_instr(this->code, ip);
 
         ip++; //jump to next instruction or to operand
         if (ip < this->code_size) emit ipChanged(ip);
 
-        msleep(250); // from QThread
+        if (trace) msleep(250); // from QThread
 
         switch (opcode) {
         case IADD:
             b = this->stack[sp--];           // 2nd opnd at top of stack
             a = this->stack[sp--];           // 1st opnd 1 below top
             this->stack[++sp] = a + b;       // push result
+            this->stack_tags[sp] = 0;
             emit spChanged(sp);
             break;
         case ISUB:
             b = this->stack[sp--];
             a = this->stack[sp--];
             this->stack[++sp] = a - b;
+            this->stack_tags[sp] = 0;
             emit spChanged(sp);
             break;
         case IMUL:
             b = this->stack[sp--];
             a = this->stack[sp--];
             this->stack[++sp] = a * b;
+            this->stack_tags[sp] = 0;
             emit spChanged(sp);
             break;
         case ILT:
             b = this->stack[sp--];
             a = this->stack[sp--];
             this->stack[++sp] = (a < b) ? true : false;
+            this->stack_tags[sp] = 0;
             emit spChanged(sp);
             break;
         case IEQ:
             b = this->stack[sp--];
             a = this->stack[sp--];
             this->stack[++sp] = (a == b) ? true : false;
+            this->stack_tags[sp] = 0;
             emit spChanged(sp);
             break;
         case BR:
             ip = this->code[ip];
+            CHARGE_RUN();
             emit ipChanged(ip);
             break;
         case BRT:
@@ -152,6 +992,7 @@ void VM::exec(int startip, bool trace)
                 emit ipChanged(ip);
                 emit spChanged(sp);
             }
+            CHARGE_RUN();
             break;
         case BRF:
             addr = this->code[ip++];
@@ -160,33 +1001,42 @@ void VM::exec(int startip, bool trace)
                 emit ipChanged(ip);
                 emit spChanged(sp);
             }
+            CHARGE_RUN();
             break;
         case ICONST:
             this->stack[++sp] = this->code[ip++];  // push operand
+            this->stack_tags[sp] = 0;
             emit ipChanged(ip);
             emit spChanged(sp);
             break;
         case LOAD: // load local or arg
             offset = this->code[ip++];
             this->stack[++sp] = this->call_stack[callsp].locals[offset];
+            this->stack_tags[sp] = this->call_stack[callsp].reftags[offset];
             emit ipChanged(ip);
             emit spChanged(sp);
             break;
         case GLOAD: // load from global memory
             addr = this->code[ip++];
             this->stack[++sp] = this->globals[addr];
+            this->stack_tags[sp] = this->global_tags.get(addr);
             emit ipChanged(ip);
             emit spChanged(sp);
             if (trace) print_data(this->globals, this->nglobals);
             break;
         case STORE:
             offset = this->code[ip++];
+            this->call_stack[callsp].reftags[offset] = this->stack_tags[sp];
             this->call_stack[callsp].locals[offset] = this->stack[sp--];
             emit ipChanged(ip);
             emit spChanged(sp);
             break;
         case GSTORE:
             addr = this->code[ip++];
+            if (!this->global_tags.set(addr, this->stack_tags[sp])) {
+                trap(ip - 1, "out of memory");
+                break;
+            }
             this->globals[addr] = this->stack[sp--];
             emit ipChanged(ip);
             emit spChanged(sp);
@@ -204,6 +1054,7 @@ void VM::exec(int startip, bool trace)
         case RET:
             ip = this->call_stack[callsp].returnip;
             callsp--; // pop context
+            CHARGE_RUN();
             emit ipChanged(ip);
             emit callSpChanged(ip);
             break;
@@ -217,20 +1068,183 @@ void VM::exec(int startip, bool trace)
                 addr = this->code[ip++];			// index of target function
                 int nargs = this->code[ip++]; 	// how many args got pushed
                 int nlocals = this->code[ip++]; 	// how many locals to allocate
+                SAVE_REGISTERS(ip - 4);
                 ++callsp; // bump stack pointer to reveal space for this call
                 context_init(&this->call_stack[callsp], ip, nargs+nlocals);
                 // copy args into new context
                 for (int i=0; i<nargs; i++) {
                     this->call_stack[callsp].locals[i] = this->stack[sp-i];
+                    this->call_stack[callsp].reftags[i] = this->stack_tags[sp-i];
                 }
                 sp -= nargs;
+                if (this->call_counts) this->call_counts[ip - 4]++;
                 ip = addr;		// jump to function
+                this->calls++;
+                CHARGE_RUN();
                 emit callSpChanged(ip);
                 emit ipChanged(ip);
                 emit spChanged(sp);
                 if (trace) print_data(this->globals, this->nglobals);
                 break;
             }
+        case NEWARR:
+            a = this->stack[sp];
+            if (a < 0) {
+                trap(ip - 1, "negative array length");
+                break;
+            }
+            this->stack_tags[sp] = 0;
+            SAVE_REGISTERS(ip - 1);     // the collector's roots
+            b = heap_alloc(a);
+            if (b == 0) {
+                trap(ip - 1, "out of memory");
+                break;
+            }
+            this->stack[sp] = b;
+            this->stack_tags[sp] = 1;
+            emit spChanged(sp);
+            break;
+        case ALOAD:
+            b = this->stack[sp];            // index
+            a = this->stack[sp - 1];        // array
+            if (!this->stack_tags[sp - 1] || b < 0 || b >= this->heap.length(a)) {
+                trap(ip - 1, "bad array access");
+                break;
+            }
+            sp--;
+            this->stack[sp] = this->heap.data(a)[b];
+            this->stack_tags[sp] = 0;
+            emit spChanged(sp);
+            break;
+        case ASTORE:
+            b = this->stack[sp - 1];        // index
+            a = this->stack[sp - 2];        // array
+            if (!this->stack_tags[sp - 2] || b < 0 || b >= this->heap.length(a)) {
+                trap(ip - 1, "bad array access");
+                break;
+            }
+            // arrays hold plain ints; storing a reference drops its tag
+            this->heap.data(a)[b] = this->stack[sp];
+            sp -= 3;
+            emit spChanged(sp);
+            break;
+        case ALEN:
+            a = this->stack[sp];
+            if (!this->stack_tags[sp]) {
+                trap(ip - 1, "not an array");
+                break;
+            }
+            this->stack[sp] = this->heap.length(a);
+            this->stack_tags[sp] = 0;
+            emit spChanged(sp);
+            break;
+        case VADD:
+        case VMUL:
+            // dst, a, b, len: one dispatch and one bounds check per range
+            addr = this->stack[sp - 3];
+            a = this->stack[sp - 2];
+            b = this->stack[sp - 1];
+            len = this->stack[sp];
+            if (!global_range(addr, len) || !global_range(a, len) || !global_range(b, len)) {
+                trap(ip - 1, "vector range out of bounds");
+                break;
+            }
+            if (PARTIAL_OVERLAP(addr, a, len) || PARTIAL_OVERLAP(addr, b, len)) {
+                trap(ip - 1, "vector destination partly overlaps a source");
+                break;
+            }
+            this->vector_dispatches++;
+            if (opcode == VADD) {
+                simd->add(this->globals + addr, this->globals + a, this->globals + b, len);
+            } else {
+                simd->mul(this->globals + addr, this->globals + a, this->globals + b, len);
+            }
+            clear_global_tags(addr, len);
+            sp -= 4;
+            emit spChanged(sp);
+            if (trace) print_data(this->globals, this->nglobals);
+            break;
+        case VSUM:
+        case VMIN:
+        case VMAX:
+            // base, len
+            a = this->stack[sp - 1];
+            len = this->stack[sp];
+            if (!global_range(a, len)) {
+                trap(ip - 1, "vector range out of bounds");
+                break;
+            }
+            sp--;
+            this->vector_dispatches++;
+            if (opcode == VSUM) {
+                this->stack[sp] = simd->sum(this->globals + a, len);
+            } else if (opcode == VMIN) {
+                this->stack[sp] = simd->min(this->globals + a, len);
+            } else {
+                this->stack[sp] = simd->max(this->globals + a, len);
+            }
+            this->stack_tags[sp] = 0;
+            emit spChanged(sp);
+            break;
+        case VFILL:
+            // base, len, value
+            addr = this->stack[sp - 2];
+            len = this->stack[sp - 1];
+            if (!global_range(addr, len)) {
+                trap(ip - 1, "vector range out of bounds");
+                break;
+            }
+            this->vector_dispatches++;
+            simd->fill(this->globals + addr, this->stack[sp], len);
+            clear_global_tags(addr, len);
+            sp -= 3;
+            emit spChanged(sp);
+            if (trace) print_data(this->globals, this->nglobals);
+            break;
+        case VCOPY:
+            // dst, src, len; ranges may overlap, references stay references
+            addr = this->stack[sp - 2];
+            a = this->stack[sp - 1];
+            len = this->stack[sp];
+            if (!global_range(addr, len) || !global_range(a, len)) {
+                trap(ip - 1, "vector range out of bounds");
+                break;
+            }
+            this->vector_dispatches++;
+            memmove(this->globals + addr, this->globals + a, (size_t)len * sizeof(int));
+            if (!this->global_tags.move(addr, a, len)) {
+                trap(ip - 1, "out of memory");
+                break;
+            }
+            sp -= 3;
+            emit spChanged(sp);
+            if (trace) print_data(this->globals, this->nglobals);
+            break;
+        case NCALL:
+            {
+                // verified at load time; arguments are passed in place and
+                // the result overwrites the first argument slot
+                if (this->call_counts && !this->natives->is_pure()) {
+                    // a profiling run must not reach the host
+                    this->shouldHalt = true;
+                    break;
+                }
+                const VM_NATIVE_ENTRY *fn = this->natives->at(this->code[ip]);
+                ip += 2;
+                sp -= fn->nargs;
+                this->native_dispatches++;
+                fn->fn(&this->stack[sp + 1], fn->data);
+                sp += fn->nresults;
+                if (fn->nresults) this->stack_tags[sp] = 0;
+                emit ipChanged(ip);
+                emit spChanged(sp);
+                break;
+            }
+        case GSYNC:
+            if (!sync_globals()) {
+                fprintf(stderr, "gsync failed at ip=%d\n", ip - 1);
+            }
+            break;
         case HALT:
             // Halt execution - loop will terminate due to condition check
             if (trace) emit hasInstruction("HALT: Program execution terminated");
@@ -240,37 +1254,135 @@ void VM::exec(int startip, bool trace)
             print_stack(this->stack, sp);
             // Update memory display periodically to show current state
 			print_data(this->globals, this->nglobals);
+            post_metrics(budget - this->fuel);
         }
         opcode = this->code[ip];
         emit opcodeChanged(opcode);
     }
+    SAVE_REGISTERS(ip);
+    return out_of_fuel;
+}
+
+void VM::exec_resume(bool trace)
+{
+    // On the VM's thread, and before the first signal: once the GUI hears
+    // of this VM, the code and address maps do not change any more
+    if (!load()) {
+        this->state = VM_TRAPPED;
+        return;
+    }
+
+    // Emit initial register values
+    emit ipChanged(this->ip);
+    emit spChanged(this->sp);
+    emit callSpChanged(this->callsp);
+    
+    // Check if starting IP is valid
+    if (this->ip < 0 || this->ip >= this->code_size) {
+        fprintf(stderr, "Invalid starting IP: %d (code size: %d)\n", this->ip, this->code_size);
+        return;
+    }
+    const int *cost = this->costs;
+    if (this->ip > this->code_size / (int)sizeof(int) || cost[this->ip] == 0) {
+        trap(this->ip, "starting IP is not an instruction");
+        return;
+    }
+
+    qint64 hw_start[3];
+    bool hw = this->hw_counters && hw_counters_read(hw_start);
+
+    // the run we start in always goes ahead, so every slice makes progress
+    qint64 budget = this->fuel;
+    this->fuel -= cost[this->ip];
+
+    // Initialize memory display at start
+    if (trace) print_data(this->globals, this->nglobals);
+    if (trace && this->restored) print_stack(this->stack, this->sp);
+
+    bool out_of_fuel;
+#ifdef __linux__
+    // An overflowing push or CALL comes back here from the SIGSEGV handler,
+    // out of dispatch() and with the registers it last stored in the VM
+    int overflow = sigsetjmp(this->guard_jump, 0);
+    if (overflow) {
+        out_of_fuel = false;
+        stack_overflow(overflow);
+    } else {
+        guarded_vm = this;
+        out_of_fuel = dispatch(trace, budget);
+    }
+    guarded_vm = nullptr;
+#else
+    out_of_fuel = dispatch(trace, budget);
+#endif
+    // out of the loop every register is in the VM, so it can be snapshotted
+    this->atSafePoint = true;
     if (trace) print_data(this->globals, this->nglobals);
+
+    int ip = this->ip;
+
+    if (out_of_fuel) {
+        // stopped at a run boundary before executing it, refund the run
+        this->fuel += cost[ip];
+    }
+    this->retired += budget - this->fuel;
+
+    if (this->state != VM_TRAPPED) {
+        if (this->shouldHalt) {
+            this->state = VM_HALTED;
+        } else if (!out_of_fuel) {
+            this->state = VM_FINISHED;
+        } else if (this->instruction_limit > 0 && this->retired + cost[ip] > this->instruction_limit) {
+            trap(ip, "instruction limit exceeded");
+        } else {
+            this->state = VM_SUSPENDED;
+        }
+    }
+
+    this->vm_metrics.add(METRIC_SLICES, 1);
+    qint64 hw_end[3];
+    if (hw && hw_counters_read(hw_end)) {
+        this->vm_metrics.add(METRIC_HW_SAMPLES, 1);
+        this->vm_metrics.add(METRIC_HW_CYCLES, hw_end[0] - hw_start[0]);
+        this->vm_metrics.add(METRIC_HW_BRANCH_MISSES, hw_end[1] - hw_start[1]);
+        this->vm_metrics.add(METRIC_HW_CACHE_MISSES, hw_end[2] - hw_start[2]);
+    }
+    if (trace) {
+        post_metrics(0);
+    } else {
+        flush_metrics(0);
+    }
 }
 
 void VM::print_instr(int *code, int ip)
 {
     int opcode = code[ip];
+    int at = source_address(ip);
     
     // Check if opcode is valid
     if (opcode < 0 || opcode >= static_cast<int>(sizeof(vm_instructions) / sizeof(VM_INSTRUCTION))) {
-        emit hasInstruction(QString("%1:  INVALID_OPCODE_%2").arg(ip, 4, 10, QLatin1Char('0')).arg(opcode));
+        emit hasInstruction(QString("%1:  INVALID_OPCODE_%2").arg(at, 4, 10, QLatin1Char('0')).arg(opcode));
         return;
     }
     
     VM_INSTRUCTION *inst = &vm_instructions[opcode];
     QString tmp;
+    int arg1 = inst->nargs > 0 ? code[ip + 1] : 0;
+    if (opcode == BR || opcode == BRT || opcode == BRF || opcode == CALL) {
+        arg1 = source_address(arg1);
+    }
     switch (inst->nargs) {
     case 0:
-        tmp = QString("%1:  %2").arg(ip, 4, 10, QLatin1Char('0')).arg(inst->name, -20);
+        tmp = QString("%1:  %2").arg(at, 4, 10, QLatin1Char('0')).arg(inst->name, -20);
         break;
     case 1:
-        tmp = QString("%1:  %2%3").arg(ip, 4, 10, QLatin1Char('0')).arg(inst->name, -10).arg(code[ip + 1], -10);
+        tmp = QString("%1:  %2%3").arg(at, 4, 10, QLatin1Char('0')).arg(inst->name, -10).arg(arg1, -10);
         break;
     case 2:
-        tmp = QString("%1:  %2%3,%4").arg(ip, 4, 10, QLatin1Char('0')).arg(inst->name, -10).arg(code[ip + 1]).arg(code[ip + 2], 10);
+        tmp = QString("%1:  %2%3,%4").arg(at, 4, 10, QLatin1Char('0')).arg(inst->name, -10).arg(arg1).arg(code[ip + 2], 10);
         break;
     case 3:
-        tmp = QString("%1:  %2%3,%4,%5").arg(ip, 4, 10, QLatin1Char('0')).arg(inst->name, -10).arg(code[ip + 1]).arg(code[ip + 2]).arg(code[ip + 3], -6);
+        tmp = QString("%1:  %2%3,%4,%5").arg(at, 4, 10, QLatin1Char('0')).arg(inst->name, -10).arg(arg1).arg(code[ip + 2]).arg(code[ip + 3], -6);
         break;
     }
     emit hasInstruction(tmp);
@@ -286,9 +1398,11 @@ void VM::print_stack(int *stack, int count)
     emit hasStack(tmp2);
 }
 
-void VM::print_data(int *globals, int count)
+void VM::print_data(int *globals, qint64 count)
 {
     QString tmp, tmp2;
+    // file-backed segments can be huge; only trace the head
+    if (count > MAX_TRACE_GLOBALS) count = MAX_TRACE_GLOBALS;
     for (int i = 0; i < count; i++) {
         tmp = QString("%1: %2\n").arg(i, 4, 10, QLatin1Char('0')).arg(globals[i]);
         tmp2 = tmp2 + tmp;
@@ -318,3 +1432,107 @@ bool VM::getPaused() const
 {
     return this->isPaused;
 }
+
+bool VM::snapshot(VMSnapshot *snap) const
+{
+    if (!this->atSafePoint) {
+        return false;
+    }
+
+    snap->clear();
+    snap->program = VMSnapshot::code_hash(this->source_code, this->source_size);
+    snap->code_size = this->source_size;
+    if (this->inlined) {
+        // the registers point into the inlined code, which goes along
+        snap->code = this->inlined_code;
+        snap->origin = this->origin;
+        snap->address_map = this->address_map;
+        snap->inline_entry = this->inline_entry;
+        snap->inlining = this->inlining;
+    }
+    snap->ip = this->ip;
+    snap->sp = this->sp;
+    snap->callsp = this->callsp;
+    snap->retired = this->retired;
+    snap->stack.resize(this->sp + 1);
+    memcpy(snap->stack.data(), this->stack, (this->sp + 1) * sizeof(int));
+    snap->call_stack.resize(this->callsp + 1);
+    memcpy(snap->call_stack.data(), this->call_stack, (this->callsp + 1) * sizeof(Context));
+    snap->set_globals(this->globals, this->nglobals);
+
+    snap->heap.resize(this->heap.used());
+    memcpy(snap->heap.data(), this->heap.arena(), this->heap.used() * sizeof(int));
+    snap->stack_tags.resize(this->sp + 1);
+    memcpy(snap->stack_tags.data(), this->stack_tags, this->sp + 1);
+    snap->global_refs = this->global_tags.tagged();
+    return true;
+}
+
+// Takes no time in the program: the snapshot brings the code it was taken
+// of, so nothing is inlined or profiled here, and load() runs later on the
+// VM's own thread
+bool VM::restore(const VMSnapshot *snap)
+{
+    if (!snap->isValid() || snap->code_size != this->source_size
+        || snap->program != VMSnapshot::code_hash(this->source_code, this->source_size)) {
+        fprintf(stderr, "snapshot does not match program (code size: %d)\n", this->source_size);
+        return false;
+    }
+    if (!this->heap.reset(snap->heap.constData(), snap->heap.size())) {
+        fprintf(stderr, "snapshot heap does not fit in memory (%d words)\n", snap->heap.size());
+        return false;
+    }
+
+    // globals are mapped copy-on-write, so the cost does not grow with nglobals
+    bool mapped;
+    int *globals = snap->map_globals(&mapped);
+    if (!globals && snap->nglobals > 0) {
+        fprintf(stderr, "snapshot globals do not fit in memory (%lld globals)\n", snap->nglobals);
+        return false;
+    }
+    release_globals();
+    this->globals = globals;
+    this->globals_mapped = mapped;
+    this->nglobals = snap->nglobals;
+    this->global_tags.reset(snap->nglobals);
+    for (int i = 0; i < snap->global_refs.size(); i++) {
+        if (!this->global_tags.set(snap->global_refs[i], 1)) {
+            fprintf(stderr, "snapshot reference map does not fit in memory\n");
+            return false;
+        }
+    }
+
+    if (!snap->code.isEmpty()) {
+        this->inlined_code = snap->code;
+        this->code = this->inlined_code.data();
+        this->code_size = this->inlined_code.size() * sizeof(int);
+        use_inlined(snap->origin, snap->address_map, snap->inline_entry, snap->inlining);
+    } else if (this->inlined) {
+        this->code = this->source_code;
+        this->code_size = this->source_size;
+        this->inlined_code.clear();
+        this->origin.clear();
+        this->address_map.clear();
+        memset(&this->inlining, 0, sizeof(this->inlining));
+        this->inlined = false;
+    }
+    this->loaded = false;
+
+    this->ip = snap->ip;
+    this->sp = snap->sp;
+    this->callsp = snap->callsp;
+    memcpy(this->stack, snap->stack.constData(), (snap->sp + 1) * sizeof(int));
+    memcpy(this->call_stack, snap->call_stack.constData(), (snap->callsp + 1) * sizeof(Context));
+
+    memcpy(this->stack_tags, snap->stack_tags.constData(), snap->sp + 1);
+
+    // a restored VM goes on from the snapshot, not from where it stopped
+    this->retired = snap->retired;
+    this->metrics_retired = snap->retired;
+    this->state = VM_SUSPENDED;
+    this->shouldHalt = false;
+    this->atSafePoint = false;
+
+    this->restored = true;
+    return true;
+}
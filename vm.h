@@ -3,20 +3,39 @@
 
 #include <QThread>
 
+#ifdef __linux__
+#include <setjmp.h>
+#endif
+
+#include "vmheap.h"
+#include "vminline.h"
+#include "vmmetrics.h"
+#include "vmnative.h"
+
 #define DEFAULT_STACK_SIZE      1000
 #define DEFAULT_CALL_STACK_SIZE 100
 #define DEFAULT_NUM_LOCALS      10
+#define MAX_TRACE_GLOBALS       1000
+
+// Bump when the instruction set or the load-time analysis changes; cached
+// load results from other versions are then ignored
+#define VM_VERSION              2
 
 typedef struct {
     int returnip;
     int locals[DEFAULT_NUM_LOCALS];
+    unsigned char reftags[DEFAULT_NUM_LOCALS];  // 1 if the local holds a heap reference
 } Context;
 
+class VMCodeCache;
+class VMSnapshot;
+class VMStackGuard;
+
 class VM : public QThread
 {
     Q_OBJECT
 public:
-    explicit VM(int *code, int code_size, int nglobals, int startip = 0, QObject *parent = nullptr);
+    explicit VM(int *code, int code_size, qint64 nglobals, int startip = 0, QObject *parent = nullptr);
     ~VM();
 
     void run() override;
@@ -27,6 +46,76 @@ public:
     void resume();
     bool getPaused() const;
 
+    // Snapshot/restore of the full VM state. snapshot() only succeeds while
+    // the VM is at a safe point: parked by pause(), or back from run_slice()
+    // or exec(). restore() must be called before start().
+    bool snapshot(VMSnapshot *snap) const;
+    bool restore(const VMSnapshot *snap);
+
+    // madvise hints for a file-backed global segment
+    typedef enum {
+        GLOBALS_NORMAL      = 0,
+        GLOBALS_SEQUENTIAL  = 1,
+        GLOBALS_RANDOM      = 2
+    } GLOBALS_ACCESS;
+
+    // Back the global segment with an mmap'd file instead of calloc'd
+    // memory. Pages are read in lazily and writes persist across runs.
+    // nglobals <= 0 takes the size from the file. Call before start().
+    // The segment is sized in 64 bits, but GLOAD/GSTORE operands and vector
+    // ranges are ints, so programs only reach its first 2^31 globals.
+    bool map_globals_file(const QString &path, qint64 nglobals, GLOBALS_ACCESS access = GLOBALS_NORMAL);
+    bool sync_globals();
+
+    const HEAP_STATS &heap_stats() const;
+
+    // Runtime counters, updated when a slice ends and after every traced
+    // step. Hardware counters are off by default; they cost two read()
+    // syscalls per slice.
+    VMMetrics &metrics();
+    void set_hardware_counters(bool enable);
+
+    // Host functions reachable through NCALL; defaults to VMNatives::standard()
+    void set_natives(const VMNatives *natives);
+    bool verify_code() const;
+    bool load();
+
+    // Reuse load() results across runs and processes; the cache must
+    // outlive the VM
+    void set_code_cache(VMCodeCache *cache);
+
+    typedef enum {
+        INLINE_OFF      = 0,
+        INLINE_STATIC   = 1,    // inline callees up to INLINE_MAX_SIZE
+        INLINE_PROFILE  = 2     // count calls in a short run first, see VMInliner
+    } INLINE_MODE;
+
+    // Run the program through VMInliner when it is loaded. The default comes
+    // from VM_INLINE=static|profile. Call before start() or restore().
+    void set_inlining(INLINE_MODE mode);
+    const INLINE_STATS &inline_stats() const;
+
+    // Address in the program as written of a word of the code that runs;
+    // inlined instructions map back into their function
+    int source_address(int addr) const;
+    static int instruction_size(int opcode);
+
+    typedef enum {
+        VM_SUSPENDED    = 0,    // not started, or out of fuel at a safe point
+        VM_FINISHED     = 1,    // reached HALT
+        VM_HALTED       = 2,    // stopped by halt()
+        VM_TRAPPED      = 3     // stopped by an error or its instruction limit
+    } VM_STATE;
+
+    // Metered execution: run until the VM stops or about fuel instructions
+    // have retired, then suspend at the next basic block boundary so a
+    // scheduler can resume it later. The limit (0 = none) caps the total
+    // over all slices and exec() runs.
+    VM_STATE run_slice(qint64 fuel);
+    void set_instruction_limit(qint64 limit);
+    qint64 instructions_retired() const;
+    VM_STATE get_state() const;
+
     typedef enum {
         NOOP    = 0,
         IADD    = 1,   // int add
@@ -46,7 +135,20 @@ public:
         POP     = 15,  // throw away top of stack
         CALL    = 16,  // call function at address with nargs,nlocals
         RET     = 17,  // return value from function
-        HALT    = 18
+        HALT    = 18,
+        GSYNC   = 19,  // flush file-backed globals to disk
+        NEWARR  = 20,  // allocate int array of length stack top
+        ALOAD   = 21,  // load array element
+        ASTORE  = 22,  // store array element
+        ALEN    = 23,  // array length
+        VADD    = 24,  // globals[dst..] = globals[a..] + globals[b..], len elements
+        VMUL    = 25,  // globals[dst..] = globals[a..] * globals[b..], len elements
+        VSUM    = 26,  // push sum of globals[base..base+len)
+        VMIN    = 27,  // push minimum of globals[base..base+len)
+        VMAX    = 28,  // push maximum of globals[base..base+len)
+        VFILL   = 29,  // globals[base..base+len) = value
+        VCOPY   = 30,  // copy len globals from src to dst
+        NCALL   = 31   // call native function with nargs
     } VM_CODE;
 
 signals:
@@ -59,35 +161,122 @@ signals:
     void callSpChanged(int newSp);
     void opcodeChanged(int opCode);
     void pausedChanged(bool paused);
+    void metricsChanged();
 
 public slots:
 
 public:
     void exec(int startip, bool trace);
-    void print_data(int *globals, int count);
+    void begin_run();
+    void exec_resume(bool trace);
+    void print_data(int *globals, qint64 count);
 
     // global variable space
     int *globals;
-    int nglobals;
+    qint64 nglobals;
     
     // pause control
     bool isPaused;
     bool shouldHalt;
+    bool atSafePoint;
 
 protected:
-    void init(int *code, int code_size, int nglobals);
+    void init(int *code, int code_size, qint64 nglobals);
+    void release_globals();
     void print_instr(int *code, int ip);
     void print_stack(int *stack, int count);
 
     void context_init(Context *ctx, int ip, int nlocals);
+    void trap(int ip, const char *msg);
+
+    bool global_range(qint64 base, qint64 len) const;
+    void clear_global_tags(qint64 base, qint64 len);
+
+    int heap_alloc(int length);
+    void collect_garbage(int need);
+
+    void alloc_stacks();
+    void release_stacks();
+    void apply_inlining();
+    int *copy_globals(bool *mapped) const;
+    void use_inlined(const QVector<int> &origin, const QVector<int> &address_map, int entry,
+                     const INLINE_STATS &stats);
+    QVector<qint64> profile_calls() const;
+    int code_address(int source) const;
+    void flush_metrics(qint64 running);
+    void post_metrics(qint64 running);
+    void stack_overflow(int which);
+    bool dispatch(bool trace, qint64 budget);
 private:
+    friend class VMStackGuard;
+
     int *code;
     int code_size;
+    int *source_code;   // the program as written; code is the inlined one once inlined
+    int source_size;
     int startip;
+    bool restored;
+
+    // registers
+    int ip;         // instruction pointer register
+    int sp;         // stack pointer register
+    int callsp;     // call stack pointer register
+
+    // true if globals is mmap'd (snapshot or file) rather than calloc'd
+    bool globals_mapped;
+    int globals_fd;     // file behind file-backed globals, -1 otherwise
+
+    // Reference map for precise GC: one tag per slot, 1 = heap reference.
+    // global_tags allocates a page of tags once a reference is stored in it.
+    unsigned char stack_tags[DEFAULT_STACK_SIZE];
+    VMTagMap global_tags;
+    VMHeap heap;
+
+    const VMNatives *natives;
+
+    // metering
+    bool loaded;
+    QVector<int> block_cost;    // instructions from ip to the next control transfer
+    const int *costs;           // block_cost, or the same table in the code cache
+    VMCodeCache *code_cache;
+    VM_STATE state;
+    qint64 fuel;
+    qint64 retired;
+    qint64 instruction_limit;
+
+    // Operand and call stacks, both grow upwards. On Linux each one ends
+    // right below a PROT_NONE guard page, so an overflow faults instead of
+    // overwriting memory and exec_resume() turns the fault into a trap.
+    int *stack;
+    Context *call_stack;
+    char *stack_guard;          // guard pages, nullptr without protection
+    char *call_guard;
+
+    // inlining; code points into inlined_code once applied
+    INLINE_MODE inline_mode;
+    bool inlined;
+    QVector<int> inlined_code;
+    QVector<int> origin;        // inlined address -> source address
+    QVector<int> address_map;   // source instruction -> inlined address
+    int inline_entry;
+    INLINE_STATS inlining;
+    qint64 *call_counts;        // per CALL address, only in profiling runs
 
-    // Operand stack, grows upwards
-    int stack[DEFAULT_STACK_SIZE];
-    Context call_stack[DEFAULT_CALL_STACK_SIZE];
+    // Metrics. Counts since the last flush_metrics(); the depth high water
+    // marks come from slots that no longer hold the paint written at
+    // allocation, so pushes and calls don't have to track them.
+    VMMetrics vm_metrics;
+    qint64 calls;
+    qint64 vector_dispatches;
+    qint64 native_dispatches;
+    qint64 paused_ns;
+    qint64 metrics_retired;     // part of retired already flushed
+    int stack_high;
+    int call_high;
+    bool hw_counters;
+#ifdef __linux__
+    sigjmp_buf guard_jump;      // where the SIGSEGV handler resumes
+#endif
 };
 
 #endif // VM_H
@@ -6,12 +6,34 @@ TEMPLATE = app
 
 SOURCES += \
         main.cpp \
+        headless.cpp \
         mainwindow.cpp \
-    vm.cpp
+        programs.cpp \
+    selftest.cpp \
+    vm.cpp \
+    vmcodecache.cpp \
+    vmheap.cpp \
+    vminline.cpp \
+    vmmetrics.cpp \
+    vmnative.cpp \
+    vmscheduler.cpp \
+    vmsimd.cpp \
+    vmsnapshot.cpp
 
 HEADERS += \
+        headless.h \
         mainwindow.h \
-    vm.h
+        programs.h \
+    selftest.h \
+    vm.h \
+    vmcodecache.h \
+    vmheap.h \
+    vminline.h \
+    vmmetrics.h \
+    vmnative.h \
+    vmscheduler.h \
+    vmsimd.h \
+    vmsnapshot.h
 
 FORMS += \
         mainwindow.ui
@@ -0,0 +1,277 @@
+#include <QByteArray>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+#include "vmcodecache.h"
+
+#define CODE_CACHE_MAGIC    0x43434d56  // "VMCC"
+#define CODE_CACHE_SUFFIX   ".vmc"
+
+#define FNV_OFFSET          0xcbf29ce484222325ULL
+#define FNV_PRIME           0x100000001b3ULL
+
+typedef struct {
+    quint32 magic;
+    quint32 version;        // VM_VERSION
+    quint64 key;
+    quint64 checksum;       // of everything after the bytecode
+    int code_size;          // bytes
+    int inline_mode;
+    int inlined_size;       // bytes of inlined code, 0 if the program runs as written
+    int entry;
+    INLINE_STATS inlining;
+    int ncosts;
+} CODE_CACHE_HEADER;
+
+static quint64 fnv1a(quint64 h, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+VMCodeCache::VMCodeCache(const QString &dir, qint64 max_bytes) : dir(dir), max_bytes(max_bytes)
+{
+    memset(&this->cache_stats, 0, sizeof(this->cache_stats));
+    if (!QDir().mkpath(dir)) {
+        fprintf(stderr, "code cache: cannot create %s\n", dir.toLocal8Bit().constData());
+    }
+}
+
+VMCodeCache::~VMCodeCache()
+{
+    for (const CODE_CACHE_MAPPING &m : this->mapped) {
+        delete m.file;
+    }
+    qDeleteAll(this->stale);
+}
+
+quint64 VMCodeCache::key(const int *code, int code_size, const VMNatives *natives, int inline_mode) const
+{
+    quint64 h = FNV_OFFSET;
+    int version = VM_VERSION;
+
+    // verification depends on the native table, and profiling on whether
+    // its natives may be called, so they are part of the key
+    h = fnv1a(h, &version, sizeof(version));
+    h = fnv1a(h, &inline_mode, sizeof(inline_mode));
+    if (natives) {
+        bool pure = natives->is_pure();
+        h = fnv1a(h, &pure, sizeof(pure));
+    }
+    for (int i = 0; natives && i < natives->count(); i++) {
+        const VM_NATIVE_ENTRY *entry = natives->at(i);
+        h = fnv1a(h, entry->name, strlen(entry->name) + 1);
+        h = fnv1a(h, &entry->nargs, sizeof(entry->nargs));
+        h = fnv1a(h, &entry->nresults, sizeof(entry->nresults));
+    }
+    return fnv1a(h, code, code_size);
+}
+
+QString VMCodeCache::path(quint64 key) const
+{
+    return QDir(this->dir).filePath(QString("%1" CODE_CACHE_SUFFIX).arg(key, 16, 16, QChar('0')));
+}
+
+// Size in bytes of what follows the bytecode in an entry
+static qint64 payload_size(const CODE_CACHE_HEADER &hdr)
+{
+    qint64 size = hdr.ncosts * (qint64)sizeof(int);
+    if (hdr.inlined_size > 0) {
+        // code, origin, address map
+        size += 2 * (qint64)hdr.inlined_size + (hdr.code_size / sizeof(int) + 1) * sizeof(int);
+    }
+    return size;
+}
+
+// The VM indexes with the entry point and the address maps unchecked, so
+// they must be in range even in an entry whose checksum matches
+static bool valid_maps(const CODE_CACHE_HEADER &hdr, const uchar *data)
+{
+    if (hdr.inlined_size == 0) {
+        return true;
+    }
+    int nsource = hdr.code_size / sizeof(int);
+    int ncode = hdr.inlined_size / sizeof(int);
+    const int *origin = (const int *)(data + sizeof(hdr) + hdr.code_size) + ncode;
+    const int *address_map = origin + ncode;
+
+    if (hdr.entry < 0 || hdr.entry >= ncode) {
+        return false;
+    }
+    for (int i = 0; i < ncode; i++) {
+        if (origin[i] < 0 || origin[i] >= nsource) return false;
+    }
+    // -1 marks an operand word, the last entry is the end of the code
+    for (int i = 0; i <= nsource; i++) {
+        if (address_map[i] < -1 || address_map[i] > ncode) return false;
+    }
+    return true;
+}
+
+// Maps and validates an entry; called with the lock held
+const uchar *VMCodeCache::map_entry(quint64 key, const int *code, int code_size)
+{
+    CODE_CACHE_MAPPING m = this->mapped.value(key, CODE_CACHE_MAPPING{ nullptr, nullptr });
+
+    if (!m.file) {
+        m.file = new QFile(path(key));
+        if (!m.file->open(QIODevice::ReadOnly)) {
+            delete m.file;
+            return nullptr;
+        }
+
+        CODE_CACHE_HEADER hdr;
+        qint64 size = m.file->size();
+        bool valid = size >= (qint64)sizeof(hdr) && (m.data = m.file->map(0, size)) != nullptr;
+        if (valid) {
+            memcpy(&hdr, m.data, sizeof(hdr));
+            int runs = hdr.inlined_size > 0 ? hdr.inlined_size : code_size;
+            valid = hdr.magic == CODE_CACHE_MAGIC && hdr.version == VM_VERSION && hdr.key == key
+                    && hdr.code_size == code_size && hdr.inlined_size >= 0
+                    && hdr.inlined_size % (int)sizeof(int) == 0
+                    && hdr.ncosts == runs / (int)sizeof(int) + 1
+                    && size == (qint64)sizeof(hdr) + hdr.code_size + payload_size(hdr)
+                    && fnv1a(FNV_OFFSET, m.data + sizeof(hdr) + hdr.code_size,
+                             payload_size(hdr)) == hdr.checksum
+                    && valid_maps(hdr, m.data);
+        }
+        if (!valid) {
+            fprintf(stderr, "code cache: dropping invalid entry %s\n",
+                    m.file->fileName().toLocal8Bit().constData());
+            this->cache_stats.rejected++;
+            m.file->close();
+            QFile::remove(path(key));
+            delete m.file;
+            return nullptr;
+        }
+
+        // recently used entries are the last to be evicted
+        m.file->setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+        this->mapped.insert(key, m);
+    }
+
+    // the key is only a hash; the stored bytecode must match exactly, or the
+    // entry is dropped so store() can replace it
+    if (memcmp(m.data + sizeof(CODE_CACHE_HEADER), code, code_size) != 0) {
+        this->cache_stats.rejected++;
+        this->mapped.remove(key);
+        this->stale.append(m.file);
+        QFile::remove(path(key));
+        return nullptr;
+    }
+    return m.data;
+}
+
+bool VMCodeCache::lookup(const int *code, int code_size, const VMNatives *natives, int inline_mode,
+                         CODE_CACHE_ENTRY *entry)
+{
+    QMutexLocker locker(&this->lock);
+
+    const uchar *data = map_entry(key(code, code_size, natives, inline_mode), code, code_size);
+    if (!data) {
+        this->cache_stats.misses++;
+        return false;
+    }
+    this->cache_stats.hits++;
+
+    CODE_CACHE_HEADER hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+    const int *p = (const int *)(data + sizeof(hdr) + hdr.code_size);
+
+    memset(entry, 0, sizeof(*entry));
+    entry->code_size = code_size;
+    if (hdr.inlined_size > 0) {
+        int ncode = hdr.inlined_size / sizeof(int);
+        entry->code = p;
+        entry->origin = p + ncode;
+        entry->address_map = p + 2 * ncode;
+        entry->code_size = hdr.inlined_size;
+        entry->entry = hdr.entry;
+        entry->inlining = hdr.inlining;
+        p += 2 * ncode + code_size / sizeof(int) + 1;
+    }
+    entry->costs = p;
+    return true;
+}
+
+void VMCodeCache::store(const int *code, int code_size, const VMNatives *natives, int inline_mode,
+                        const CODE_CACHE_ENTRY *entry)
+{
+    CODE_CACHE_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CODE_CACHE_MAGIC;
+    hdr.version = VM_VERSION;
+    hdr.key = key(code, code_size, natives, inline_mode);
+    hdr.code_size = code_size;
+    hdr.inline_mode = inline_mode;
+    if (entry->code) {
+        hdr.inlined_size = entry->code_size;
+        hdr.entry = entry->entry;
+        hdr.inlining = entry->inlining;
+    }
+    hdr.ncosts = entry->code_size / sizeof(int) + 1;
+
+    // everything after the bytecode, in file order
+    QByteArray payload;
+    if (entry->code) {
+        payload.append((const char *)entry->code, entry->code_size);
+        payload.append((const char *)entry->origin, entry->code_size);
+        payload.append((const char *)entry->address_map, (code_size / sizeof(int) + 1) * sizeof(int));
+    }
+    payload.append((const char *)entry->costs, hdr.ncosts * sizeof(int));
+    hdr.checksum = fnv1a(FNV_OFFSET, payload.constData(), payload.size());
+
+    // written under a temporary name and renamed, so readers never see half an entry
+    QSaveFile file(path(hdr.key));
+    if (!file.open(QIODevice::WriteOnly)) {
+        fprintf(stderr, "code cache: cannot write %s\n", file.fileName().toLocal8Bit().constData());
+        return;
+    }
+    file.write((const char *)&hdr, sizeof(hdr));
+    file.write((const char *)code, code_size);
+    file.write(payload.constData(), payload.size());
+    if (!file.commit()) {
+        fprintf(stderr, "code cache: cannot write %s\n", file.fileName().toLocal8Bit().constData());
+        return;
+    }
+
+    QMutexLocker locker(&this->lock);
+    this->cache_stats.stores++;
+    evict();
+}
+
+// Removes the least recently used entries until the directory fits in
+// max_bytes; called with the lock held
+void VMCodeCache::evict()
+{
+    QFileInfoList entries = QDir(this->dir).entryInfoList(QStringList() << "*" CODE_CACHE_SUFFIX,
+                                                           QDir::Files, QDir::Time);
+    qint64 total = 0;
+    for (const QFileInfo &info : entries) {
+        total += info.size();
+    }
+
+    // sorted newest first
+    for (int i = entries.size() - 1; i >= 0 && total > this->max_bytes; i--) {
+        if (QFile::remove(entries[i].filePath())) {
+            total -= entries[i].size();
+            this->cache_stats.evictions++;
+        }
+    }
+}
+
+CODE_CACHE_STATS VMCodeCache::stats() const
+{
+    QMutexLocker locker(&this->lock);
+    return this->cache_stats;
+}
@@ -0,0 +1,82 @@
+#ifndef VMCODECACHE_H
+#define VMCODECACHE_H
+
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+#include "vminline.h"
+#include "vmnative.h"
+
+#define DEFAULT_CODE_CACHE_SIZE (64 * 1024 * 1024)     // bytes on disk
+
+typedef struct {
+    qint64 hits;
+    qint64 misses;
+    qint64 stores;
+    qint64 evictions;
+    qint64 rejected;        // entries that failed validation
+} CODE_CACHE_STATS;
+
+// What load() produces for a program: its block cost table and, when the
+// inliner rewrote it, the code that runs with the maps back to the source
+typedef struct {
+    const int *costs;           // per word of the code that runs, plus one
+    const int *code;            // inlined program, nullptr if it runs as written
+    const int *origin;          // per word of code
+    const int *address_map;     // per source word, plus one
+    int code_size;              // bytes of code
+    int entry;                  // where the inlined program starts
+    INLINE_STATS inlining;
+} CODE_CACHE_ENTRY;
+
+typedef struct {
+    QFile *file;
+    const uchar *data;
+} CODE_CACHE_MAPPING;
+
+// Directory of load-time artifacts, so a program only goes through
+// verification and analysis the first time any process runs it.
+//
+// Entries are named after a hash of the bytecode, the VM version, the
+// native table it was verified against and the inlining mode. An entry
+// holds a header, a copy of the bytecode, the inlined program with its
+// address maps if there is one, and the block cost table, all int aligned,
+// so it is used straight from a read-only mapping. When the directory grows
+// past max_bytes the least recently used entries are removed.
+//
+// Pointers returned by lookup() stay valid for the life of the cache.
+class VMCodeCache
+{
+public:
+    explicit VMCodeCache(const QString &dir, qint64 max_bytes = DEFAULT_CODE_CACHE_SIZE);
+    ~VMCodeCache();
+
+    // The load() results for a program as written, false on a miss
+    bool lookup(const int *code, int code_size, const VMNatives *natives, int inline_mode,
+                CODE_CACHE_ENTRY *entry);
+    void store(const int *code, int code_size, const VMNatives *natives, int inline_mode,
+               const CODE_CACHE_ENTRY *entry);
+
+    CODE_CACHE_STATS stats() const;
+
+private:
+    Q_DISABLE_COPY(VMCodeCache)
+
+    quint64 key(const int *code, int code_size, const VMNatives *natives, int inline_mode) const;
+    QString path(quint64 key) const;
+    const uchar *map_entry(quint64 key, const int *code, int code_size);
+    void evict();
+
+    QString dir;
+    qint64 max_bytes;
+
+    mutable QMutex lock;
+    QHash<quint64, CODE_CACHE_MAPPING> mapped;     // entries mapped by this process
+    QVector<QFile *> stale;     // replaced mappings, possibly still in use
+    CODE_CACHE_STATS cache_stats;
+};
+
+#endif // VMCODECACHE_H
@@ -0,0 +1,220 @@
+#include <QElapsedTimer>
+
+#include <string.h>
+
+#include "vmheap.h"
+
+#define FORWARD_UNMARKED    -1
+
+VMHeap::VMHeap() : words(nullptr), top(0), capacity(0)
+{
+    memset(&this->heap_stats, 0, sizeof(this->heap_stats));
+    grow(DEFAULT_HEAP_SIZE);
+}
+
+VMHeap::~VMHeap()
+{
+    free(this->words);
+}
+
+bool VMHeap::grow(qint64 size)
+{
+    if (size > MAX_HEAP_SIZE) {
+        return false;
+    }
+    // references are offsets, so moving the arena doesn't invalidate them
+    int *words = (int *)realloc(this->words, size * sizeof(int));
+    if (!words) {
+        return false;
+    }
+    this->words = words;
+    this->capacity = size;
+    this->heap_stats.capacity = size * sizeof(int);
+    return true;
+}
+
+int VMHeap::alloc(int length)
+{
+    qint64 size = HEAP_HEADER_SIZE + (qint64)length;
+    if (this->top + size > this->capacity) {
+        return 0;
+    }
+
+    int *obj = &this->words[this->top];
+    obj[0] = length;
+    obj[1] = FORWARD_UNMARKED;
+    memset(&obj[HEAP_HEADER_SIZE], 0, length * sizeof(int));
+
+    int ref = (int)this->top + 1;
+    this->top += size;
+    this->heap_stats.objects_allocated++;
+    this->heap_stats.bytes_allocated += size * sizeof(int);
+    return ref;
+}
+
+void VMHeap::collect(const QVector<int *> &roots, int need)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // mark: arrays hold plain ints, so the roots are the whole live set
+    for (qint64 off = 0; off < this->top; off += HEAP_HEADER_SIZE + this->words[off]) {
+        this->words[off + 1] = FORWARD_UNMARKED;
+    }
+    for (int i = 0; i < roots.size(); i++) {
+        this->words[*roots[i]] = 0;
+    }
+
+    // compute forwarding addresses
+    qint64 free = 0;
+    for (qint64 off = 0; off < this->top; off += HEAP_HEADER_SIZE + this->words[off]) {
+        if (this->words[off + 1] != FORWARD_UNMARKED) {
+            this->words[off + 1] = (int)free;
+            free += HEAP_HEADER_SIZE + this->words[off];
+        }
+    }
+
+    // update roots, then slide objects down
+    for (int i = 0; i < roots.size(); i++) {
+        *roots[i] = this->words[*roots[i]] + 1;
+    }
+    for (qint64 off = 0, size = 0; off < this->top; off += size) {
+        size = HEAP_HEADER_SIZE + this->words[off];
+        int forward = this->words[off + 1];
+        if (forward != FORWARD_UNMARKED && forward != off) {
+            memmove(&this->words[forward], &this->words[off], size * sizeof(int));
+        }
+    }
+    this->top = free;
+
+    // double if possible, else take just what the request needs; if that
+    // fails too, or the request can never fit, alloc() reports it
+    qint64 want = this->top + HEAP_HEADER_SIZE + (qint64)need;
+    if (want > this->capacity && want <= MAX_HEAP_SIZE && !grow(qMin(qMax(this->capacity * 2, want), (qint64)MAX_HEAP_SIZE))) {
+        grow(want);
+    }
+
+    qint64 pause = timer.nsecsElapsed();
+    this->heap_stats.collections++;
+    this->heap_stats.gc_pause_total_ns += pause;
+    this->heap_stats.gc_pause_max_ns = qMax(this->heap_stats.gc_pause_max_ns, pause);
+    this->heap_stats.bytes_live = this->top * sizeof(int);
+}
+
+bool VMHeap::reset(const int *words, qint64 top)
+{
+    if (top > this->capacity && !grow(top)) {
+        return false;
+    }
+    memcpy(this->words, words, top * sizeof(int));
+    this->top = top;
+    return true;
+}
+
+VMTagMap::VMTagMap() : pages(nullptr), npages(0), size(0)
+{
+}
+
+VMTagMap::~VMTagMap()
+{
+    reset(0);
+}
+
+void VMTagMap::reset(qint64 size)
+{
+    if (this->pages) {
+        for (qint64 p = 0; p < this->npages; p++) {
+            free(this->pages[p]);
+        }
+        free(this->pages);
+    }
+    this->pages = nullptr;
+    this->npages = (size + TAG_PAGE_SIZE - 1) >> TAG_PAGE_SHIFT;
+    this->size = size;
+}
+
+bool VMTagMap::set(qint64 i, unsigned char tag)
+{
+    unsigned char *page = this->pages ? this->pages[i >> TAG_PAGE_SHIFT] : nullptr;
+    if (!page) {
+        if (!tag) {
+            return true;
+        }
+        if (!this->pages) {
+            this->pages = (unsigned char **)calloc(this->npages, sizeof(unsigned char *));
+            if (!this->pages) {
+                return false;
+            }
+        }
+        page = (unsigned char *)calloc(TAG_PAGE_SIZE, 1);
+        if (!page) {
+            return false;
+        }
+        this->pages[i >> TAG_PAGE_SHIFT] = page;
+    }
+    page[i & (TAG_PAGE_SIZE - 1)] = tag;
+    return true;
+}
+
+void VMTagMap::clear(qint64 base, qint64 len)
+{
+    if (!this->pages || len <= 0) {
+        return;
+    }
+    for (qint64 p = base >> TAG_PAGE_SHIFT; p <= (base + len - 1) >> TAG_PAGE_SHIFT; p++) {
+        if (!this->pages[p]) continue;
+        qint64 start = qMax(base, p << TAG_PAGE_SHIFT);
+        qint64 end = qMin(base + len, (p + 1) << TAG_PAGE_SHIFT);
+        memset(this->pages[p] + (start & (TAG_PAGE_SIZE - 1)), 0, end - start);
+    }
+}
+
+// Copies len tags from src to dst; the ranges may overlap, as with memmove
+bool VMTagMap::move(qint64 dst, qint64 src, qint64 len)
+{
+    if (!this->pages || dst == src) {
+        return true;
+    }
+    if (dst < src) {
+        for (qint64 i = 0; i < len; i++) {
+            if (!set(dst + i, get(src + i))) return false;
+        }
+    } else {
+        for (qint64 i = len - 1; i >= 0; i--) {
+            if (!set(dst + i, get(src + i))) return false;
+        }
+    }
+    return true;
+}
+
+void VMTagMap::roots(int *values, QVector<int *> &roots) const
+{
+    if (!this->pages) {
+        return;
+    }
+    for (qint64 p = 0; p < this->npages; p++) {
+        if (!this->pages[p]) continue;
+        qint64 base = p << TAG_PAGE_SHIFT;
+        qint64 end = qMin((qint64)TAG_PAGE_SIZE, this->size - base);
+        for (qint64 i = 0; i < end; i++) {
+            if (this->pages[p][i]) roots.append(&values[base + i]);
+        }
+    }
+}
+
+QVector<qint64> VMTagMap::tagged() const
+{
+    QVector<qint64> tagged;
+    if (!this->pages) {
+        return tagged;
+    }
+    for (qint64 p = 0; p < this->npages; p++) {
+        if (!this->pages[p]) continue;
+        qint64 base = p << TAG_PAGE_SHIFT;
+        qint64 end = qMin((qint64)TAG_PAGE_SIZE, this->size - base);
+        for (qint64 i = 0; i < end; i++) {
+            if (this->pages[p][i]) tagged.append(base + i);
+        }
+    }
+    return tagged;
+}
@@ -0,0 +1,99 @@
+#ifndef VMHEAP_H
+#define VMHEAP_H
+
+#include <QVector>
+
+#include <limits.h>
+
+#define DEFAULT_HEAP_SIZE       65536   // words
+#define MAX_HEAP_SIZE           INT_MAX // words; references and forwarding addresses are ints
+#define HEAP_HEADER_SIZE        2       // length, forwarding address
+#define TAG_PAGE_SHIFT          12      // 4096 reference tags per VMTagMap page
+#define TAG_PAGE_SIZE           (1 << TAG_PAGE_SHIFT)
+
+typedef struct {
+    qint64 objects_allocated;
+    qint64 bytes_allocated;
+    qint64 collections;
+    qint64 gc_pause_total_ns;
+    qint64 gc_pause_max_ns;
+    qint64 bytes_live;          // after the last collection
+    qint64 capacity;            // arena size in bytes
+} HEAP_STATS;
+
+// Per-VM arena of int arrays. Allocation bumps a pointer and fails when the
+// arena is full; the VM then runs collect() with its root slots. The
+// collector is precise mark-compact: it slides live objects down, rewrites
+// the roots and grows the arena if the request still doesn't fit. The
+// arena never grows past MAX_HEAP_SIZE words; alloc() keeps failing when
+// the request does not fit even after a collection, or memory runs out.
+//
+// A reference is the word offset of an object's header plus one, so 0 is
+// never a valid reference.
+class VMHeap
+{
+public:
+    VMHeap();
+    ~VMHeap();
+
+    int alloc(int length);
+
+    // roots: every slot currently holding a reference
+    void collect(const QVector<int *> &roots, int need);
+    bool reset(const int *words, qint64 top);
+
+    int length(int ref) const { return this->words[ref - 1]; }
+    int *data(int ref) const { return &this->words[ref + 1]; }
+
+    const int *arena() const { return this->words; }
+    qint64 used() const { return this->top; }
+    const HEAP_STATS &stats() const { return this->heap_stats; }
+
+private:
+    Q_DISABLE_COPY(VMHeap)
+
+    bool grow(qint64 size);
+
+    int *words;
+    qint64 top;         // bump pointer
+    qint64 capacity;
+    HEAP_STATS heap_stats;
+};
+
+// Reference tags of the globals, one per slot, 1 = heap reference. A page
+// of tags is only allocated once a reference is stored in it, so a large
+// global segment holding a few references costs a few pages, and the
+// collector only scans the pages that exist.
+class VMTagMap
+{
+public:
+    VMTagMap();
+    ~VMTagMap();
+
+    // all tags clear for size slots
+    void reset(qint64 size);
+
+    unsigned char get(qint64 i) const
+    {
+        if (!this->pages) return 0;
+        const unsigned char *page = this->pages[i >> TAG_PAGE_SHIFT];
+        return page ? page[i & (TAG_PAGE_SIZE - 1)] : 0;
+    }
+    // false when the page for a reference cannot be allocated
+    bool set(qint64 i, unsigned char tag);
+    void clear(qint64 base, qint64 len);
+    bool move(qint64 dst, qint64 src, qint64 len);
+
+    // appends &values[i] for every tagged slot i
+    void roots(int *values, QVector<int *> &roots) const;
+    QVector<qint64> tagged() const;
+
+private:
+    Q_DISABLE_COPY(VMTagMap)
+
+    unsigned char **pages;  // one per TAG_PAGE_SIZE slots, nullptr until needed
+    qint64 npages;
+    qint64 size;
+};
+
+#endif // VMHEAP_H
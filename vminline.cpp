@@ -0,0 +1,282 @@
+#include <string.h>
+
+#include "vm.h"
+#include "vminline.h"
+
+typedef struct {
+    int callee;             // index into the pass's function list
+    int base;               // first caller slot used for the callee's locals
+    int folded;             // leading arguments specialized to constants
+    int constants[DEFAULT_NUM_LOCALS];
+} INLINE_SITE;
+
+static bool is_branch(int op)
+{
+    return op == VM::BR || op == VM::BRT || op == VM::BRF;
+}
+
+VMInliner::VMInliner(const int *code, int ncode, int startip)
+    : entry(startip), original_size(ncode), wrapped(false)
+{
+    memset(&this->stats, 0, sizeof(this->stats));
+
+    this->code.resize(ncode);
+    memcpy(this->code.data(), code, ncode * sizeof(int));
+    this->origin.resize(ncode);
+    this->address_map.resize(ncode + 1);
+    for (int i = 0; i <= ncode; i++) {
+        if (i < ncode) this->origin[i] = i;
+        this->address_map[i] = i;
+    }
+}
+
+void VMInliner::set_profile(const QVector<qint64> &counts)
+{
+    this->profile = counts;
+}
+
+bool VMInliner::run()
+{
+    while (this->stats.passes < INLINE_MAX_PASSES && pass()) {
+        this->stats.passes++;
+    }
+    return this->stats.sites > 0;
+}
+
+bool VMInliner::pass()
+{
+    const int n = this->code.size();
+    const int *c = this->code.constData();
+
+    // decode
+    QVector<int> starts;
+    QVector<char> is_target(n + 1, 0);
+    QVector<int> funcs;                     // [0] is the entry, then CALL targets
+    funcs.append(this->entry);
+    for (int i = 0; i < n; i += VM::instruction_size(c[i])) {
+        starts.append(i);
+        if (is_branch(c[i])) is_target[c[i + 1]] = 1;
+        if (c[i] == VM::CALL && !funcs.contains(c[i + 1])) funcs.append(c[i + 1]);
+    }
+    const int nf = funcs.size();
+
+    // what each function reaches, and which function owns each instruction
+    // (-2 when more than one does)
+    QVector<QVector<char> > reach(nf, QVector<char>(n, 0));
+    QVector<int> owner(n, -1);
+    for (int f = 0; f < nf; f++) {
+        QVector<int> work;
+        work.append(funcs[f]);
+        while (!work.isEmpty()) {
+            int i = work.last();
+            work.removeLast();
+            if (i < 0 || i >= n || reach[f][i]) continue;
+            reach[f][i] = 1;
+            owner[i] = owner[i] == -1 || owner[i] == f ? f : -2;
+
+            int op = c[i];
+            int next = i + VM::instruction_size(op);
+            if (is_branch(op)) work.append(c[i + 1]);
+            if (op != VM::BR && op != VM::RET && op != VM::HALT) work.append(next);
+        }
+    }
+
+    // body size, locals and leafness per function
+    QVector<int> size(nf, 0), frame(nf, 0);
+    QVector<char> leaf(nf, 1);
+    QVector<QVector<char> > stored(nf, QVector<char>(DEFAULT_NUM_LOCALS, 0));
+    for (int f = 0; f < nf; f++) {
+        for (int i : starts) {
+            if (!reach[f][i]) continue;
+            int op = c[i];
+            if (op == VM::CALL) leaf[f] = 0;
+            if (op != VM::RET) size[f] += VM::instruction_size(op);
+            if (op == VM::LOAD || op == VM::STORE) frame[f] = qMax(frame[f], c[i + 1] + 1);
+            if (op == VM::STORE) stored[f][c[i + 1]] = 1;
+        }
+    }
+    for (int i : starts) {
+        if (c[i] == VM::CALL) {
+            int g = funcs.indexOf(c[i + 1]);
+            frame[g] = qMax(frame[g], c[i + 2] + c[i + 3]);
+        }
+    }
+
+    // choose the call sites
+    QVector<int> extra(nf, 0);              // slots added to each frame
+    QVector<char> dropped(n, 0);            // ICONSTs folded into a site
+    QVector<int> site_at(n, -1);
+    QVector<INLINE_SITE> sites;
+    int growth = 0;
+
+    for (int k = 0; k < starts.size(); k++) {
+        int i = starts[k];
+        if (c[i] != VM::CALL) continue;
+
+        int f = owner[i];
+        int g = funcs.indexOf(c[i + 1]);
+        int nargs = c[i + 2];
+        if (f < 0 || (f == 0 && this->wrapped) || g <= 0 || g == f || !leaf[g]) continue;
+
+        int limit = INLINE_MAX_SIZE;
+        if (!this->profile.isEmpty()) {
+            qint64 calls = this->origin[i] < this->profile.size() ? this->profile[this->origin[i]] : 0;
+            if (calls == 0) continue;
+            if (calls >= INLINE_HOT_CALLS) limit = INLINE_HOT_SIZE;
+        }
+        if (size[g] > limit || n + growth + size[g] > INLINE_MAX_GROWTH * this->original_size) continue;
+
+        INLINE_SITE site;
+        site.callee = g;
+        site.base = frame[f];
+        site.folded = 0;
+
+        // locals[j] is the j-th value from the top, so the ICONST right
+        // before the CALL is argument 0; the instructions after a folded
+        // ICONST must only be reachable through it
+        while (site.folded < nargs && k - 1 - site.folded >= 0) {
+            int p = starts[k - 1 - site.folded];
+            if (c[p] != VM::ICONST || stored[g][site.folded] || is_target[starts[k - site.folded]]) break;
+            site.constants[site.folded] = c[p + 1];
+            site.folded++;
+        }
+
+        // slots the inlined body touches
+        int needed = nargs > site.folded ? nargs : 0;
+        for (int b : starts) {
+            if (reach[g][b] && (c[b] == VM::STORE || (c[b] == VM::LOAD && c[b + 1] >= site.folded))) {
+                needed = qMax(needed, c[b + 1] + 1);
+            }
+        }
+        if (needed > 0 && site.base + needed > DEFAULT_NUM_LOCALS) continue;
+
+        for (int j = 0; j < site.folded; j++) {
+            dropped[starts[k - 1 - j]] = 1;
+        }
+        extra[f] = qMax(extra[f], needed);
+        growth += size[g];
+        site_at[i] = sites.size();
+        sites.append(site);
+    }
+    if (sites.isEmpty()) {
+        return false;
+    }
+
+    // emit the new program
+    QVector<int> out, out_origin;
+    QVector<int> map(n + 1, -1);
+    QVector<int> patches;                   // words holding an old address
+
+    for (int i : starts) {
+        map[i] = out.size();
+        if (dropped[i]) continue;
+
+        int op = c[i];
+        int len = VM::instruction_size(op);
+
+        if (site_at[i] < 0) {
+            for (int w = 0; w < len; w++) {
+                out.append(c[i + w]);
+                out_origin.append(this->origin[i + w]);
+            }
+            if (is_branch(op) || op == VM::CALL) patches.append(out.size() - len + 1);
+            if (op == VM::CALL) {
+                // room for what was inlined into the callee
+                int h = funcs.indexOf(c[i + 1]);
+                if (extra[h] > 0) {
+                    out[out.size() - 1] = qMax(c[i + 3], frame[h] + extra[h] - c[i + 2]);
+                }
+            }
+            continue;
+        }
+
+        const INLINE_SITE &site = sites[site_at[i]];
+        const QVector<char> &body = reach[site.callee];
+        this->stats.sites++;
+        this->stats.constant_args += site.folded;
+
+        // pop the remaining arguments, top first
+        for (int j = site.folded; j < c[i + 2]; j++) {
+            out.append(VM::STORE);
+            out.append(site.base + j);
+            out_origin.append(this->origin[i]);
+            out_origin.append(this->origin[i + 1]);
+        }
+
+        int last = -1;
+        for (int b : starts) {
+            if (body[b]) last = b;
+        }
+
+        QVector<int> local(n, -1);
+        QVector<int> local_patches, returns;
+        for (int b : starts) {
+            if (!body[b]) continue;
+            local[b] = out.size();
+
+            int bop = c[b];
+            int blen = VM::instruction_size(bop);
+            if (bop == VM::RET) {
+                if (b == last) continue;    // falls through to the continuation
+                out.append(VM::BR);
+                out.append(0);
+                out_origin.append(this->origin[b]);
+                out_origin.append(this->origin[b]);
+                returns.append(out.size() - 1);
+                continue;
+            }
+
+            int pos = out.size();
+            for (int w = 0; w < blen; w++) {
+                out.append(c[b + w]);
+                out_origin.append(this->origin[b + w]);
+            }
+            if (bop == VM::LOAD && c[b + 1] < site.folded) {
+                out[pos] = VM::ICONST;
+                out[pos + 1] = site.constants[c[b + 1]];
+            } else if (bop == VM::LOAD || bop == VM::STORE) {
+                out[pos + 1] = site.base + c[b + 1];
+            } else if (is_branch(bop)) {
+                local_patches.append(pos + 1);
+            }
+        }
+
+        int cont = out.size();
+        for (int p : returns) {
+            out[p] = cont;
+        }
+        for (int p : local_patches) {
+            int target = out[p];
+            out[p] = local[target] >= 0 ? local[target] : cont;
+        }
+    }
+    map[n] = out.size();
+
+    for (int p : patches) {
+        out[p] = map[out[p]];
+    }
+
+    if (extra[0] > 0 && !this->wrapped) {
+        // top-level code needs a frame for what was inlined into it
+        int old_entry = map[this->entry];
+        this->entry = out.size();
+        out.append(VM::CALL);
+        out.append(old_entry);
+        out.append(0);
+        out.append(extra[0]);
+        out.append(VM::HALT);
+        for (int w = 0; w < 5; w++) {
+            out_origin.append(this->origin[funcs[0]]);
+        }
+        this->wrapped = true;
+    } else {
+        this->entry = map[this->entry];
+    }
+
+    for (int i = 0; i < this->address_map.size(); i++) {
+        if (this->address_map[i] >= 0) this->address_map[i] = map[this->address_map[i]];
+    }
+    this->code = out;
+    this->origin = out_origin;
+    return true;
+}
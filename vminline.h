@@ -0,0 +1,58 @@
+#ifndef VMINLINE_H
+#define VMINLINE_H
+
+#include <QVector>
+
+#define INLINE_MAX_SIZE     16      // words of callee body, RETs not counted
+#define INLINE_HOT_SIZE     64      // limit for call sites the profile shows are hot
+#define INLINE_HOT_CALLS    1000    // calls in the profiling run that make a site hot
+#define INLINE_MAX_PASSES   4
+#define INLINE_MAX_GROWTH   4       // inlined program at most this many times the original
+#define INLINE_PROFILE_FUEL 1000000 // instructions of the profiling run
+
+typedef struct {
+    int sites;              // CALLs replaced by the callee's body
+    int constant_args;      // ICONST arguments folded into the inlined body
+    int passes;
+} INLINE_STATS;
+
+// Load-time inliner. Each pass splices the bodies of leaf functions (no
+// CALL in anything reachable from their entry) into the call sites of
+// functions that have room for their locals; repeated passes work up the
+// call graph, and recursive functions are never leaves.
+//
+// The callee's locals move to unused slots of the caller's frame: the
+// arguments are popped into them with STOREs and its LOAD/STOREs are
+// renumbered. Arguments pushed by an ICONST right before the CALL and never
+// stored to by the callee are specialized: the ICONST is dropped and LOADs
+// of the argument become that ICONST. Top-level code has no frame, so if it
+// needs one the program gets a new entry that CALLs the old one.
+//
+// Input must have passed VM::verify_code().
+class VMInliner
+{
+public:
+    VMInliner(const int *code, int ncode, int startip);
+
+    // Call counts by original CALL address from a profiling run. Sites that
+    // never ran are left alone, hot ones may take bigger callees.
+    void set_profile(const QVector<qint64> &counts);
+
+    // Returns false if no call site was inlined
+    bool run();
+
+    QVector<int> code;
+    QVector<int> origin;        // original address of every word of code
+    QVector<int> address_map;   // original instruction start -> address in code
+    int entry;                  // where execution starts in code
+    INLINE_STATS stats;
+
+private:
+    bool pass();
+
+    QVector<qint64> profile;
+    int original_size;
+    bool wrapped;               // entry is the CALL added for a root frame
+};
+
+#endif // VMINLINE_H
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "vmmetrics.h"
+
+static const char *metric_names[METRIC_COUNT] = {
+    "retired",
+    "dispatch_vector",
+    "dispatch_native",
+    "calls",
+    "slices",
+    "max_stack_depth",
+    "max_call_depth",
+    "paused_ns",
+    "gui_posted",
+    "gui_delivered",
+    "gui_backlog_max",
+    "hw_samples",
+    "hw_cycles",
+    "hw_branch_misses",
+    "hw_cache_misses"
+};
+
+static std::atomic<quint64> next_metrics_id(1);
+
+VMMetrics::VMMetrics() : id(next_metrics_id++)
+{
+}
+
+VMMetrics::~VMMetrics()
+{
+    for (VM_METRICS_BLOCK *block : this->blocks) {
+        delete block;
+    }
+}
+
+// The calling thread's block; the last one used is remembered per thread
+VM_METRICS_BLOCK *VMMetrics::local()
+{
+    static thread_local quint64 cached_id = 0;
+    static thread_local VM_METRICS_BLOCK *cached_block = nullptr;
+
+    if (cached_id == this->id) {
+        return cached_block;
+    }
+
+    QMutexLocker locker(&this->lock);
+    Qt::HANDLE self = QThread::currentThreadId();
+    VM_METRICS_BLOCK *block = nullptr;
+    for (VM_METRICS_BLOCK *b : this->blocks) {
+        if (b->thread == self) {
+            block = b;
+            break;
+        }
+    }
+    if (!block) {
+        block = new VM_METRICS_BLOCK;
+        block->thread = self;
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            block->values[i].store(0, std::memory_order_relaxed);
+        }
+        this->blocks.append(block);
+    }
+
+    cached_id = this->id;
+    cached_block = block;
+    return block;
+}
+
+void VMMetrics::add(VM_METRIC metric, qint64 value)
+{
+    // only this thread writes the block, so a plain load and store will do
+    std::atomic<qint64> &v = local()->values[metric];
+    v.store(v.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void VMMetrics::raise(VM_METRIC metric, qint64 value)
+{
+    std::atomic<qint64> &v = local()->values[metric];
+    if (value > v.load(std::memory_order_relaxed)) {
+        v.store(value, std::memory_order_relaxed);
+    }
+}
+
+void VMMetrics::read(qint64 values[METRIC_COUNT]) const
+{
+    QMutexLocker locker(&this->lock);
+
+    memset(values, 0, METRIC_COUNT * sizeof(qint64));
+    for (const VM_METRICS_BLOCK *block : this->blocks) {
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            qint64 v = block->values[i].load(std::memory_order_relaxed);
+            if (is_max(i)) {
+                if (v > values[i]) values[i] = v;
+            } else {
+                values[i] += v;
+            }
+        }
+    }
+}
+
+qint64 VMMetrics::value(VM_METRIC metric) const
+{
+    qint64 values[METRIC_COUNT];
+    read(values);
+    return values[metric];
+}
+
+const char *VMMetrics::name(int metric)
+{
+    return metric >= 0 && metric < METRIC_COUNT ? metric_names[metric] : "unknown";
+}
+
+bool VMMetrics::is_max(int metric)
+{
+    return metric == METRIC_MAX_STACK_DEPTH || metric == METRIC_MAX_CALL_DEPTH
+           || metric == METRIC_GUI_BACKLOG_MAX;
+}
+
+#ifdef __linux__
+// One counter group per thread, opened on first use and left running
+class HWCounters
+{
+public:
+    HWCounters() : state(0)
+    {
+        for (int i = 0; i < 3; i++) this->fds[i] = -1;
+    }
+
+    ~HWCounters()
+    {
+        for (int i = 0; i < 3; i++) {
+            if (this->fds[i] >= 0) close(this->fds[i]);
+        }
+    }
+
+    bool read(qint64 values[3])
+    {
+        if (this->state == 0) open_group();
+        if (this->state < 0) return false;
+
+        struct {
+            quint64 nr;
+            quint64 values[3];
+        } group;
+        if (::read(this->fds[0], &group, sizeof(group)) != (ssize_t)sizeof(group) || group.nr != 3) {
+            return false;
+        }
+        for (int i = 0; i < 3; i++) values[i] = group.values[i];
+        return true;
+    }
+
+private:
+    static int open_counter(quint64 config, int leader)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        return syscall(SYS_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+    }
+
+    void open_group()
+    {
+        static const quint64 configs[3] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES
+        };
+        this->state = 1;
+        for (int i = 0; i < 3; i++) {
+            this->fds[i] = open_counter(configs[i], i == 0 ? -1 : this->fds[0]);
+            if (this->fds[i] < 0) {
+                static std::atomic<bool> warned(false);
+                if (!warned.exchange(true)) perror("perf_event_open");
+                this->state = -1;
+                return;
+            }
+        }
+    }
+
+    int state;          // 0 not opened yet, 1 running, -1 unavailable
+    int fds[3];         // cycles leads the group
+};
+
+bool hw_counters_read(qint64 values[3])
+{
+    static thread_local HWCounters counters;
+    return counters.read(values);
+}
+#else
+bool hw_counters_read(qint64 values[3])
+{
+    Q_UNUSED(values);
+    return false;
+}
+#endif
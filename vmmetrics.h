@@ -0,0 +1,66 @@
+#ifndef VMMETRICS_H
+#define VMMETRICS_H
+
+#include <QMutex>
+#include <QThread>
+#include <QVector>
+
+#include <atomic>
+
+typedef enum {
+    METRIC_RETIRED = 0,         // instructions, also the interpreter's dispatches
+    METRIC_DISPATCH_VECTOR,     // vector kernel calls
+    METRIC_DISPATCH_NATIVE,     // host function calls
+    METRIC_CALLS,               // bytecode CALLs
+    METRIC_SLICES,              // entries into the dispatch loop
+    METRIC_MAX_STACK_DEPTH,
+    METRIC_MAX_CALL_DEPTH,
+    METRIC_PAUSED_NS,
+    METRIC_GUI_POSTED,          // trace steps sent to the GUI
+    METRIC_GUI_DELIVERED,       // trace steps the GUI has processed
+    METRIC_GUI_BACKLOG_MAX,
+    METRIC_HW_SAMPLES,          // slices measured with hardware counters
+    METRIC_HW_CYCLES,
+    METRIC_HW_BRANCH_MISSES,
+    METRIC_HW_CACHE_MISSES,
+    METRIC_COUNT
+} VM_METRIC;
+
+typedef struct alignas(64) {
+    Qt::HANDLE thread;
+    std::atomic<qint64> values[METRIC_COUNT];
+} VM_METRICS_BLOCK;
+
+// Counters of one VM. Every thread that updates them gets its own block,
+// written without locks or atomic read-modify-writes; read() sums the
+// blocks, or takes the largest value for the METRIC_MAX_* entries.
+class VMMetrics
+{
+public:
+    VMMetrics();
+    ~VMMetrics();
+
+    void add(VM_METRIC metric, qint64 value);
+    void raise(VM_METRIC metric, qint64 value);
+
+    void read(qint64 values[METRIC_COUNT]) const;
+    qint64 value(VM_METRIC metric) const;
+
+    static const char *name(int metric);
+    static bool is_max(int metric);
+
+private:
+    Q_DISABLE_COPY(VMMetrics)
+
+    VM_METRICS_BLOCK *local();
+
+    quint64 id;         // never reused, unlike the address
+    mutable QMutex lock;
+    QVector<VM_METRICS_BLOCK *> blocks;
+};
+
+// Cycles, branch misses and cache misses of the calling thread, user space
+// only, from perf_event_open(). Returns false where they are not available.
+bool hw_counters_read(qint64 values[3]);
+
+#endif // VMMETRICS_H
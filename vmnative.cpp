@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "vmnative.h"
+
+int VMNatives::add(const char *name, VM_NATIVE fn, int nargs, int nresults, void *data)
+{
+    if (nargs < 0 || nresults < 0 || nresults > 1) {
+        fprintf(stderr, "native %s: bad signature (%d args, %d results)\n", name, nargs, nresults);
+        return -1;
+    }
+
+    VM_NATIVE_ENTRY entry = { name, fn, nargs, nresults, data };
+    this->entries.append(entry);
+    return this->entries.size() - 1;
+}
+
+int VMNatives::find(const char *name) const
+{
+    for (int i = 0; i < this->entries.size(); i++) {
+        if (strcmp(this->entries[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void native_nop(int *, void *)
+{
+}
+
+static void native_hash32(int *args, void *)
+{
+    unsigned h = (unsigned)args[0];
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    args[0] = (int)h;
+}
+
+static void native_isqrt(int *args, void *)
+{
+    int x = args[0];
+    int r = 0;
+    if (x > 0) {
+        // bit-by-bit integer square root
+        unsigned n = (unsigned)x;
+        unsigned bit = 1u << 30;
+        unsigned res = 0;
+        while (bit > n) bit >>= 2;
+        while (bit) {
+            if (n >= res + bit) {
+                n -= res + bit;
+                res = (res >> 1) + bit;
+            } else {
+                res >>= 1;
+            }
+            bit >>= 2;
+        }
+        r = (int)res;
+    }
+    args[0] = r;
+}
+
+static void native_imin(int *args, void *)
+{
+    args[0] = args[0] < args[1] ? args[0] : args[1];
+}
+
+static void native_imax(int *args, void *)
+{
+    args[0] = args[0] > args[1] ? args[0] : args[1];
+}
+
+static VMNatives *make_standard()
+{
+    VMNatives *natives = new VMNatives();
+    natives->add("nop",     native_nop,     0, 0);
+    natives->add("hash32",  native_hash32,  1, 1);
+    natives->add("isqrt",   native_isqrt,   1, 1);
+    natives->add("imin",    native_imin,    2, 1);
+    natives->add("imax",    native_imax,    2, 1);
+    natives->set_pure(true);
+    return natives;
+}
+
+const VMNatives *VMNatives::standard()
+{
+    static const VMNatives *natives = make_standard();
+    return natives;
+}
@@ -0,0 +1,56 @@
+#ifndef VMNATIVE_H
+#define VMNATIVE_H
+
+#include <QVector>
+
+// A native function works directly on the operand stack: args points at
+// the first of its nargs arguments, and it writes its nresults results
+// over the start of the same slots.
+typedef void (*VM_NATIVE)(int *args, void *data);
+
+typedef struct {
+    const char *name;
+    VM_NATIVE fn;
+    int nargs;
+    int nresults;       // 0 or 1
+    void *data;         // passed back to fn
+} VM_NATIVE_ENTRY;
+
+// Indices of the functions in VMNatives::standard()
+enum {
+    NATIVE_NOP      = 0,    // () -> ()
+    NATIVE_HASH32   = 1,    // (x) -> murmur3 finalizer of x
+    NATIVE_ISQRT    = 2,    // (x) -> floor(sqrt(x)), 0 for x < 0
+    NATIVE_IMIN     = 3,    // (a, b) -> min
+    NATIVE_IMAX     = 4     // (a, b) -> max
+};
+
+// Host function table, indexed by the first operand of NCALL. A VM checks
+// every NCALL against the table before it starts executing.
+//
+// Profile-guided inlining runs the program once before it really runs. Its
+// natives are only called then if the table is marked pure: every function
+// in it has no effect beyond its results. Otherwise profiling stops at the
+// first NCALL. The standard table is pure.
+class VMNatives
+{
+public:
+    VMNatives() : pure(false) {}
+
+    int add(const char *name, VM_NATIVE fn, int nargs, int nresults, void *data = nullptr);
+    int find(const char *name) const;
+
+    const VM_NATIVE_ENTRY *at(int index) const { return &this->entries[index]; }
+    int count() const { return this->entries.size(); }
+
+    void set_pure(bool pure) { this->pure = pure; }
+    bool is_pure() const { return this->pure; }
+
+    static const VMNatives *standard();
+
+private:
+    QVector<VM_NATIVE_ENTRY> entries;
+    bool pure;
+};
+
+#endif // VMNATIVE_H
@@ -0,0 +1,70 @@
+#include "vmscheduler.h"
+
+class VMWorker : public QThread
+{
+public:
+    explicit VMWorker(VMScheduler *scheduler) : scheduler(scheduler) {}
+    void run() override { this->scheduler->work(); }
+
+private:
+    VMScheduler *scheduler;
+};
+
+VMScheduler::VMScheduler(int nthreads, qint64 slice) : nthreads(nthreads), slice(slice), remaining(0)
+{
+    if (this->nthreads < 1) this->nthreads = 1;
+}
+
+int VMScheduler::submit(VM *vm, qint64 limit)
+{
+    QMutexLocker locker(&this->lock);
+
+    VM_JOB job = { vm, VM::VM_SUSPENDED, 0 };
+    vm->set_instruction_limit(limit);
+    this->jobs.append(job);
+    this->ready.enqueue(this->jobs.size() - 1);
+    this->remaining++;
+    return this->jobs.size() - 1;
+}
+
+void VMScheduler::run()
+{
+    QVector<VMWorker *> workers;
+    for (int i = 0; i < this->nthreads; i++) {
+        workers.append(new VMWorker(this));
+        workers[i]->start();
+    }
+    for (int i = 0; i < workers.size(); i++) {
+        workers[i]->wait();
+        delete workers[i];
+    }
+}
+
+void VMScheduler::work()
+{
+    this->lock.lock();
+    while (this->remaining > 0) {
+        if (this->ready.isEmpty()) {
+            // every job is on some other worker; one may come back
+            this->changed.wait(&this->lock);
+            continue;
+        }
+
+        int id = this->ready.dequeue();
+        VM *vm = this->jobs[id].vm;
+        this->lock.unlock();
+
+        VM::VM_STATE state = vm->run_slice(this->slice);
+
+        this->lock.lock();
+        this->jobs[id].slices++;
+        this->jobs[id].state = state;
+        if (state == VM::VM_SUSPENDED) {
+            this->ready.enqueue(id);
+        } else {
+            this->remaining--;
+        }
+        this->changed.wakeAll();
+    }
+    this->lock.unlock();
+}
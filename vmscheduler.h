@@ -0,0 +1,49 @@
+#ifndef VMSCHEDULER_H
+#define VMSCHEDULER_H
+
+#include <QMutex>
+#include <QQueue>
+#include <QVector>
+#include <QWaitCondition>
+
+#include "vm.h"
+
+#define DEFAULT_SLICE 10000     // instructions per time slice
+
+typedef struct {
+    VM *vm;
+    VM::VM_STATE state;
+    int slices;
+} VM_JOB;
+
+// Runs many VMs on a few threads. Each job gets a time slice of metered
+// instructions, then goes to the back of the ready queue if it suspended,
+// so a runaway job can't starve the others and is stopped by its limit.
+class VMScheduler
+{
+public:
+    explicit VMScheduler(int nthreads = QThread::idealThreadCount(), qint64 slice = DEFAULT_SLICE);
+
+    // limit: total instructions for the job, 0 for none. Returns the job id.
+    int submit(VM *vm, qint64 limit = 0);
+
+    // Blocks until every job has finished, halted or trapped
+    void run();
+
+    const VM_JOB &job(int id) const { return this->jobs[id]; }
+    int count() const { return this->jobs.size(); }
+
+    void work();
+
+private:
+    int nthreads;
+    qint64 slice;
+
+    QMutex lock;
+    QWaitCondition changed;
+    QVector<VM_JOB> jobs;
+    QQueue<int> ready;
+    int remaining;
+};
+
+#endif // VMSCHEDULER_H
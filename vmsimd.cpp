@@ -0,0 +1,247 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vmsimd.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define VM_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// scalar fallback
+
+static void scalar_add(int *dst, const int *a, const int *b, qint64 n)
+{
+    for (qint64 i = 0; i < n; i++) dst[i] = (int)((unsigned)a[i] + (unsigned)b[i]);
+}
+
+static void scalar_mul(int *dst, const int *a, const int *b, qint64 n)
+{
+    for (qint64 i = 0; i < n; i++) dst[i] = (int)((unsigned)a[i] * (unsigned)b[i]);
+}
+
+static int scalar_sum(const int *a, qint64 n)
+{
+    unsigned s = 0;
+    for (qint64 i = 0; i < n; i++) s += (unsigned)a[i];
+    return (int)s;
+}
+
+static int scalar_min(const int *a, qint64 n)
+{
+    int m = INT_MAX;
+    for (qint64 i = 0; i < n; i++) if (a[i] < m) m = a[i];
+    return m;
+}
+
+static int scalar_max(const int *a, qint64 n)
+{
+    int m = INT_MIN;
+    for (qint64 i = 0; i < n; i++) if (a[i] > m) m = a[i];
+    return m;
+}
+
+static void scalar_fill(int *dst, int value, qint64 n)
+{
+    for (qint64 i = 0; i < n; i++) dst[i] = value;
+}
+
+static const VM_SIMD_KERNELS scalar_kernels = {
+    "scalar", scalar_add, scalar_mul, scalar_sum, scalar_min, scalar_max, scalar_fill
+};
+
+#ifdef VM_SIMD_X86
+
+// SSE4.1: 4 lanes
+
+__attribute__((target("sse4.1")))
+static void sse_add(int *dst, const int *a, const int *b, qint64 n)
+{
+    qint64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi32(va, vb));
+    }
+    scalar_add(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void sse_mul(int *dst, const int *a, const int *b, qint64 n)
+{
+    qint64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_mullo_epi32(va, vb));
+    }
+    scalar_mul(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static int sse_sum(const int *a, qint64 n)
+{
+    __m128i acc = _mm_setzero_si128();
+    qint64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i *)(a + i)));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (int)((unsigned)_mm_cvtsi128_si32(acc) + (unsigned)scalar_sum(a + i, n - i));
+}
+
+__attribute__((target("sse4.1")))
+static int sse_min(const int *a, qint64 n)
+{
+    __m128i acc = _mm_set1_epi32(INT_MAX);
+    qint64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_min_epi32(acc, _mm_loadu_si128((const __m128i *)(a + i)));
+    }
+    acc = _mm_min_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_min_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    int m = _mm_cvtsi128_si32(acc);
+    int t = scalar_min(a + i, n - i);
+    return t < m ? t : m;
+}
+
+__attribute__((target("sse4.1")))
+static int sse_max(const int *a, qint64 n)
+{
+    __m128i acc = _mm_set1_epi32(INT_MIN);
+    qint64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_max_epi32(acc, _mm_loadu_si128((const __m128i *)(a + i)));
+    }
+    acc = _mm_max_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_max_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    int m = _mm_cvtsi128_si32(acc);
+    int t = scalar_max(a + i, n - i);
+    return t > m ? t : m;
+}
+
+__attribute__((target("sse4.1")))
+static void sse_fill(int *dst, int value, qint64 n)
+{
+    __m128i v = _mm_set1_epi32(value);
+    qint64 i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    scalar_fill(dst + i, value, n - i);
+}
+
+static const VM_SIMD_KERNELS sse_kernels = {
+    "sse4.1", sse_add, sse_mul, sse_sum, sse_min, sse_max, sse_fill
+};
+
+// AVX2: 8 lanes, reduced through the SSE kernels' horizontal step
+
+__attribute__((target("avx2")))
+static void avx2_add(int *dst, const int *a, const int *b, qint64 n)
+{
+    qint64 i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi32(va, vb));
+    }
+    scalar_add(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_mul(int *dst, const int *a, const int *b, qint64 n)
+{
+    qint64 i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_mullo_epi32(va, vb));
+    }
+    scalar_mul(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int avx2_sum(const int *a, qint64 n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    qint64 i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_add_epi32(acc, _mm256_loadu_si256((const __m256i *)(a + i)));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return (int)((unsigned)sse_sum(lanes, 8) + (unsigned)sse_sum(a + i, n - i));
+}
+
+__attribute__((target("avx2")))
+static int avx2_min(const int *a, qint64 n)
+{
+    __m256i acc = _mm256_set1_epi32(INT_MAX);
+    qint64 i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_min_epi32(acc, _mm256_loadu_si256((const __m256i *)(a + i)));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    int m = sse_min(lanes, 8);
+    int t = sse_min(a + i, n - i);
+    return t < m ? t : m;
+}
+
+__attribute__((target("avx2")))
+static int avx2_max(const int *a, qint64 n)
+{
+    __m256i acc = _mm256_set1_epi32(INT_MIN);
+    qint64 i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_max_epi32(acc, _mm256_loadu_si256((const __m256i *)(a + i)));
+    }
+    int lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    int m = sse_max(lanes, 8);
+    int t = sse_max(a + i, n - i);
+    return t > m ? t : m;
+}
+
+__attribute__((target("avx2")))
+static void avx2_fill(int *dst, int value, qint64 n)
+{
+    __m256i v = _mm256_set1_epi32(value);
+    qint64 i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    scalar_fill(dst + i, value, n - i);
+}
+
+static const VM_SIMD_KERNELS avx2_kernels = {
+    "avx2", avx2_add, avx2_mul, avx2_sum, avx2_min, avx2_max, avx2_fill
+};
+
+#endif // VM_SIMD_X86
+
+static const VM_SIMD_KERNELS *detect_kernels()
+{
+    const char *force = getenv("VM_SIMD");
+
+#ifdef VM_SIMD_X86
+    __builtin_cpu_init();
+    bool scalar = force && strcmp(force, "scalar") == 0;
+    bool sse = force && strcmp(force, "sse4.1") == 0;
+
+    if (!scalar && !sse && __builtin_cpu_supports("avx2")) return &avx2_kernels;
+    if (!scalar && __builtin_cpu_supports("sse4.1")) return &sse_kernels;
+#else
+    (void)force;
+#endif
+    return &scalar_kernels;
+}
+
+const VM_SIMD_KERNELS *simd_kernels()
+{
+    static const VM_SIMD_KERNELS *kernels = detect_kernels();
+    return kernels;
+}
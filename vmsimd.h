@@ -0,0 +1,24 @@
+#ifndef VMSIMD_H
+#define VMSIMD_H
+
+#include <QtGlobal>
+
+// Kernels behind the vector opcodes. All arithmetic wraps like 32-bit
+// two's complement, so every implementation gives identical results. For
+// add and mul, dst must either be a source or not overlap it at all; the
+// VM traps on partial overlap.
+typedef struct {
+    const char *name;
+    void (*add)(int *dst, const int *a, const int *b, qint64 n);
+    void (*mul)(int *dst, const int *a, const int *b, qint64 n);
+    int (*sum)(const int *a, qint64 n);
+    int (*min)(const int *a, qint64 n);     // INT_MAX for n == 0
+    int (*max)(const int *a, qint64 n);     // INT_MIN for n == 0
+    void (*fill)(int *dst, int value, qint64 n);
+} VM_SIMD_KERNELS;
+
+// Best kernels for this CPU (avx2, sse4.1 or scalar), detected once.
+// The VM_SIMD environment variable can force a weaker set for comparison.
+const VM_SIMD_KERNELS *simd_kernels();
+
+#endif // VMSIMD_H
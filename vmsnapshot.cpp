@@ -0,0 +1,264 @@
+#include <limits.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "vmsnapshot.h"
+
+#define SNAPSHOT_MAGIC      0x53534d56  // "VMSS"
+#define SNAPSHOT_VERSION    6
+
+#define FNV_OFFSET          0xcbf29ce484222325ULL
+#define FNV_PRIME           0x100000001b3ULL
+
+typedef struct {
+    quint32 magic;
+    quint32 version;
+    quint64 program;
+    int code_size;
+    int ip;
+    int sp;
+    int callsp;
+    qint64 retired;
+    qint64 nglobals;
+    qint64 heap_words;
+    qint64 global_refs;
+    int inlined_words;      // 0 if the program ran as written
+    int inline_entry;
+    INLINE_STATS inlining;
+} SNAPSHOT_HEADER;
+
+VMSnapshot::VMSnapshot() : image(nullptr), globals_fd(-1)
+{
+    clear();
+}
+
+VMSnapshot::~VMSnapshot()
+{
+    clear();
+}
+
+void VMSnapshot::clear()
+{
+#ifdef __linux__
+    if (this->globals_fd >= 0) {
+        if (this->image) munmap(this->image, (size_t)this->nglobals * sizeof(int));
+        close(this->globals_fd);
+    } else
+#endif
+    free(this->image);
+
+    this->image = nullptr;
+    this->globals_fd = -1;
+    this->program = 0;
+    this->code_size = 0;
+    this->ip = -1;
+    this->sp = -1;
+    this->callsp = -1;
+    this->retired = 0;
+    this->stack.clear();
+    this->call_stack.clear();
+    this->nglobals = 0;
+    this->heap.clear();
+    this->stack_tags.clear();
+    this->global_refs.clear();
+    this->code.clear();
+    this->origin.clear();
+    this->address_map.clear();
+    this->inline_entry = 0;
+    memset(&this->inlining, 0, sizeof(this->inlining));
+}
+
+bool VMSnapshot::isValid() const
+{
+    return this->ip >= 0;
+}
+
+quint64 VMSnapshot::code_hash(const int *code, int code_size)
+{
+    const unsigned char *p = (const unsigned char *)code;
+    quint64 h = FNV_OFFSET;
+    for (int i = 0; i < code_size; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+void VMSnapshot::set_globals(const int *globals, qint64 nglobals)
+{
+    size_t bytes = (size_t)nglobals * sizeof(int);
+
+    this->nglobals = nglobals;
+    if (nglobals <= 0) return;
+
+#ifdef __linux__
+    // Write the image once into a memfd; restores map it MAP_PRIVATE
+    this->globals_fd = memfd_create("vm-globals", MFD_CLOEXEC);
+    if (this->globals_fd >= 0 && ftruncate(this->globals_fd, bytes) == 0) {
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, this->globals_fd, 0);
+        if (p != MAP_FAILED) {
+            this->image = (int *)p;
+            memcpy(this->image, globals, bytes);
+            return;
+        }
+    }
+    if (this->globals_fd >= 0) close(this->globals_fd);
+    this->globals_fd = -1;
+#endif
+    this->image = (int *)malloc(bytes);
+    memcpy(this->image, globals, bytes);
+}
+
+int *VMSnapshot::map_globals(bool *mapped) const
+{
+    size_t bytes = (size_t)this->nglobals * sizeof(int);
+
+    *mapped = false;
+    if (this->nglobals <= 0) return (int *)calloc(0, sizeof(int));
+
+#ifdef __linux__
+    if (this->globals_fd >= 0) {
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, this->globals_fd, 0);
+        if (p != MAP_FAILED) {
+            *mapped = true;
+            return (int *)p;
+        }
+    }
+#endif
+    int *globals = (int *)malloc(bytes);
+    if (globals) memcpy(globals, this->image, bytes);
+    return globals;
+}
+
+QByteArray VMSnapshot::serialize() const
+{
+    SNAPSHOT_HEADER hdr;
+    memset(&hdr, 0, sizeof(hdr));   // padding goes to disk too
+    hdr.magic = SNAPSHOT_MAGIC;
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.program = this->program;
+    hdr.code_size = this->code_size;
+    hdr.ip = this->ip;
+    hdr.sp = this->sp;
+    hdr.callsp = this->callsp;
+    hdr.retired = this->retired;
+    hdr.nglobals = this->nglobals;
+    hdr.heap_words = this->heap.size();
+    hdr.global_refs = this->global_refs.size();
+    hdr.inlined_words = this->code.size();
+    hdr.inline_entry = this->inline_entry;
+    hdr.inlining = this->inlining;
+
+    QByteArray data;
+    data.reserve(sizeof(hdr) + (this->sp + 1) * (sizeof(int) + 1)
+                 + (this->callsp + 1) * sizeof(Context) + this->nglobals * sizeof(int)
+                 + this->heap.size() * sizeof(int) + this->global_refs.size() * sizeof(qint64)
+                 + (this->code.size() + this->origin.size() + this->address_map.size()) * sizeof(int));
+    data.append((const char *)&hdr, sizeof(hdr));
+    data.append((const char *)this->stack.constData(), (this->sp + 1) * sizeof(int));
+    data.append((const char *)this->call_stack.constData(), (this->callsp + 1) * sizeof(Context));
+    if (this->nglobals > 0) data.append((const char *)this->image, this->nglobals * sizeof(int));
+    data.append((const char *)this->heap.constData(), this->heap.size() * sizeof(int));
+    data.append((const char *)this->stack_tags.constData(), this->sp + 1);
+    data.append((const char *)this->global_refs.constData(), this->global_refs.size() * sizeof(qint64));
+    data.append((const char *)this->code.constData(), this->code.size() * sizeof(int));
+    data.append((const char *)this->origin.constData(), this->origin.size() * sizeof(int));
+    data.append((const char *)this->address_map.constData(), this->address_map.size() * sizeof(int));
+    return data;
+}
+
+bool VMSnapshot::deserialize(const QByteArray &data)
+{
+    SNAPSHOT_HEADER hdr;
+
+    clear();
+    if (data.size() < (int)sizeof(hdr)) return false;
+    memcpy(&hdr, data.constData(), sizeof(hdr));
+
+    if (hdr.magic != SNAPSHOT_MAGIC || hdr.version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "snapshot: bad magic or version\n");
+        return false;
+    }
+    if (hdr.ip < 0 || hdr.retired < 0 || hdr.sp < -1 || hdr.sp >= DEFAULT_STACK_SIZE
+        || hdr.callsp < -1 || hdr.callsp >= DEFAULT_CALL_STACK_SIZE || hdr.nglobals < 0
+        || hdr.heap_words < 0 || hdr.heap_words > INT_MAX
+        || hdr.global_refs < 0 || hdr.global_refs > hdr.nglobals
+        || hdr.code_size < 0 || hdr.inlined_words < 0
+        || (hdr.inlined_words > 0 && (hdr.inline_entry < 0 || hdr.inline_entry >= hdr.inlined_words))) {
+        fprintf(stderr, "snapshot: registers out of range\n");
+        return false;
+    }
+    int nsource = hdr.code_size / sizeof(int);
+    qint64 expected = sizeof(hdr) + (qint64)(hdr.sp + 1) * (sizeof(int) + 1)
+                      + (qint64)(hdr.callsp + 1) * sizeof(Context) + hdr.nglobals * (qint64)sizeof(int)
+                      + hdr.heap_words * (qint64)sizeof(int) + hdr.global_refs * (qint64)sizeof(qint64)
+                      + (hdr.inlined_words > 0 ? 2 * (qint64)hdr.inlined_words + nsource + 1 : 0) * sizeof(int);
+    if (data.size() != expected) {
+        fprintf(stderr, "snapshot: size mismatch (%d, expected %lld)\n", data.size(), expected);
+        return false;
+    }
+
+    const char *p = data.constData() + sizeof(hdr);
+    this->stack.resize(hdr.sp + 1);
+    memcpy(this->stack.data(), p, (hdr.sp + 1) * sizeof(int));
+    p += (hdr.sp + 1) * sizeof(int);
+    this->call_stack.resize(hdr.callsp + 1);
+    memcpy(this->call_stack.data(), p, (hdr.callsp + 1) * sizeof(Context));
+    p += (hdr.callsp + 1) * sizeof(Context);
+    set_globals((const int *)p, hdr.nglobals);
+    p += hdr.nglobals * sizeof(int);
+    this->heap.resize(hdr.heap_words);
+    memcpy(this->heap.data(), p, hdr.heap_words * sizeof(int));
+    p += hdr.heap_words * sizeof(int);
+    this->stack_tags.resize(hdr.sp + 1);
+    memcpy(this->stack_tags.data(), p, hdr.sp + 1);
+    p += hdr.sp + 1;
+    this->global_refs.resize(hdr.global_refs);
+    memcpy(this->global_refs.data(), p, hdr.global_refs * sizeof(qint64));
+    for (int i = 0; i < this->global_refs.size(); i++) {
+        if (this->global_refs[i] < 0 || this->global_refs[i] >= hdr.nglobals) {
+            fprintf(stderr, "snapshot: reference outside the globals\n");
+            clear();
+            return false;
+        }
+    }
+    p += hdr.global_refs * sizeof(qint64);
+    if (hdr.inlined_words > 0) {
+        this->code.resize(hdr.inlined_words);
+        memcpy(this->code.data(), p, hdr.inlined_words * sizeof(int));
+        p += hdr.inlined_words * sizeof(int);
+        this->origin.resize(hdr.inlined_words);
+        memcpy(this->origin.data(), p, hdr.inlined_words * sizeof(int));
+        p += hdr.inlined_words * sizeof(int);
+        this->address_map.resize(nsource + 1);
+        memcpy(this->address_map.data(), p, (nsource + 1) * sizeof(int));
+
+        // the VM verifies the code itself, but indexes with the maps
+        bool valid = true;
+        for (int i = 0; i < this->origin.size(); i++) {
+            if (this->origin[i] < 0 || this->origin[i] >= nsource) valid = false;
+        }
+        for (int i = 0; i < this->address_map.size(); i++) {
+            if (this->address_map[i] < -1 || this->address_map[i] > hdr.inlined_words) valid = false;
+        }
+        if (!valid) {
+            fprintf(stderr, "snapshot: address map out of range\n");
+            clear();
+            return false;
+        }
+        this->inline_entry = hdr.inline_entry;
+        this->inlining = hdr.inlining;
+    }
+
+    this->program = hdr.program;
+    this->code_size = hdr.code_size;
+    this->ip = hdr.ip;
+    this->sp = hdr.sp;
+    this->callsp = hdr.callsp;
+    this->retired = hdr.retired;
+    return true;
+}
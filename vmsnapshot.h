@@ -0,0 +1,67 @@
+#ifndef VMSNAPSHOT_H
+#define VMSNAPSHOT_H
+
+#include <QByteArray>
+#include <QVector>
+
+#include "vm.h"
+
+// Full VM state captured at a safe point: registers, the live part of the
+// operand and call stacks, the global space, the heap and the reference tags.
+//
+// On Linux the globals image lives in a memfd, so every VM restored from the
+// same snapshot gets a private copy-on-write mapping of it instead of a copy.
+class VMSnapshot
+{
+public:
+    VMSnapshot();
+    ~VMSnapshot();
+
+    void clear();
+    bool isValid() const;
+
+    // Compact serialized form: header, live stack, live call stack, globals,
+    // heap, the stack reference tags, the globals holding references, then
+    // the inlined code and its address maps
+    QByteArray serialize() const;
+    bool deserialize(const QByteArray &data);
+
+    void set_globals(const int *globals, qint64 nglobals);
+    int *map_globals(bool *mapped) const;
+    const int *globals() const { return this->image; }
+
+    // FNV-1a of the bytecode; a snapshot only restores into the program,
+    // as it runs, that it was taken from
+    static quint64 code_hash(const int *code, int code_size);
+
+    quint64 program;    // code_hash() of that program
+    int code_size;
+    int ip;
+    int sp;
+    int callsp;
+    qint64 retired;     // instructions run up to it, counted against the limit
+
+    QVector<int> stack;             // stack[0..sp]
+    QVector<Context> call_stack;    // call_stack[0..callsp]
+    qint64 nglobals;
+
+    QVector<int> heap;                      // used part of the arena
+    QVector<unsigned char> stack_tags;      // stack_tags[0..sp]
+    QVector<qint64> global_refs;            // globals that hold a reference
+
+    // The inlined program the registers point into; all empty if the
+    // program ran as written
+    QVector<int> code;
+    QVector<int> origin;
+    QVector<int> address_map;
+    int inline_entry;
+    INLINE_STATS inlining;
+
+private:
+    Q_DISABLE_COPY(VMSnapshot)
+
+    int *image;         // globals image, shared mapping of globals_fd on Linux
+    int globals_fd;     // memfd backing the image, -1 when not used
+};
+
+#endif // VMSNAPSHOT_H